@@ -0,0 +1,54 @@
+#include <XBotLogger/Logger.hpp>
+
+#include <chrono>
+
+using XBot::MatLogger;
+
+/* Measures the average time spent by add() for a given handle and sample */
+template <typename Function>
+void benchmark(const std::string& name, int n_samples, Function add_sample)
+{
+    auto tic = std::chrono::steady_clock::now();
+
+    for(int i = 0; i < n_samples; i++)
+    {
+        add_sample(i);
+    }
+
+    auto toc = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(toc - tic).count() / n_samples;
+
+    std::cout << name << ": " << ns << " ns per sample" << std::endl;
+}
+
+int main(int argc, char **argv){
+
+    const int n_samples = argc > 1 ? std::atoi(argv[1]) : 1000000;
+    const int buffer_size = 1 << 16;
+
+    auto logger = MatLogger::getLogger("/tmp/add_benchmark");
+
+    auto scalar_handle = logger->createFixedVariable<double>("scalar", 1, buffer_size);
+    auto vector3_handle = logger->createFixedVariable<Eigen::Vector3d>("vector3", 1, buffer_size);
+    auto raw_handle = logger->createVectorVariable("raw3", 3, 1, buffer_size);
+    auto dynamic_handle = logger->createVectorVariable("dynamic3", 3, 1, buffer_size);
+    auto matrix4_handle = logger->createFixedVariable<Eigen::Matrix4d>("matrix4", 1, buffer_size);
+    auto float_handle = logger->createFixedVariable<Eigen::Matrix4f>("matrix4f", 1, buffer_size);
+    auto vector30_handle = logger->createVectorVariable("vector30", 30, 1, buffer_size);
+
+    Eigen::Vector3d vector3 = Eigen::Vector3d::Random();
+    Eigen::VectorXd dynamic3 = Eigen::VectorXd::Random(3);
+    Eigen::Matrix4d matrix4 = Eigen::Matrix4d::Random();
+    Eigen::VectorXd vector30 = Eigen::VectorXd::Random(30);
+    double raw3[3] = {1.0, 2.0, 3.0};
+
+    benchmark("double", n_samples, [&](int i){ logger->add(scalar_handle, (double)i); });
+    benchmark("Eigen::Vector3d", n_samples, [&](int){ logger->add(vector3_handle, vector3); });
+    benchmark("double[3]", n_samples, [&](int){ logger->add(raw_handle, raw3, 3); });
+    benchmark("Eigen::VectorXd(3)", n_samples, [&](int){ logger->add(dynamic_handle, dynamic3); });
+    benchmark("Eigen::Matrix4d", n_samples, [&](int){ logger->add(matrix4_handle, matrix4); });
+    benchmark("Eigen::Matrix4d as float", n_samples, [&](int){ logger->add(float_handle, matrix4); });
+    benchmark("Eigen::VectorXd(30)", n_samples, [&](int){ logger->add(vector30_handle, vector30); });
+
+}
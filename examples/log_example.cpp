@@ -14,6 +14,12 @@ int main(int argc, char **argv){
     Eigen::MatrixXf eigen_values_matrix;
     double scalar_value;
     
+    /* Preallocate a variable and keep its handle for fast logging */
+    auto scalar_handle = logger->createScalarVariable("scalar_value");
+    
+    /* Group signals which are logged together into a record */
+    auto record_handle = logger->createRecord<Eigen::Vector3d, Eigen::Matrix3f, int>({"position", "orientation", "iteration"});
+    
     for(int i = 0; i < 100; i++)
     {
         std_values.assign(10, std::sin(2*M_PI*i/20));
@@ -24,7 +30,8 @@ int main(int argc, char **argv){
         logger->add("std_values", std_values);
         logger->add("eigen_values", eigen_values);
         logger->add("eigen_values_matrix", eigen_values_matrix);
-        logger->add("scalar_value", scalar_value);
+        logger->add(scalar_handle, scalar_value);
+        logger->add(record_handle, Eigen::Vector3d::Constant(scalar_value), Eigen::Matrix3f::Identity(), i);
     }
     
     /* Save one giant matrix */
@@ -0,0 +1,63 @@
+#include <XBotLogger/Logger.hpp>
+
+#include <chrono>
+#include <thread>
+
+using XBot::MatLogger;
+
+/* Logs at a fixed rate while the streamed file is rotated every few megabytes:
+ * sealing a segment must never stall the writer thread long enough for the
+ * (deliberately small) circular buffers to overflow. Exits with 1 if any sample
+ * has been dropped. */
+int main(int argc, char **argv){
+
+    const double duration = argc > 1 ? std::atof(argv[1]) : 5.0;
+    const int rate = 2000;
+    const int n_vars = 20;
+
+    auto logger = MatLogger::getLogger("/tmp/stream_rotation");
+
+    MatLogger::StreamingOptions options;
+    options.buffer_bytes = 64*1024;         // about 130 ms of samples for each variable
+    options.segment_bytes = 4*1024*1024;
+    options.overflow_policy = MatLogger::OverflowPolicy::DropNewest;
+
+    /* Sealing with the best compression keeps the rotation busy */
+    logger->setCompression(MatLogger::Compression::Best);
+
+    if( !logger->startStreaming(options) ){
+        return 1;
+    }
+
+    std::vector<MatLogger::VectorHandle> handles;
+
+    for( int i = 0; i < n_vars; i++ ){
+        handles.push_back(logger->createVectorVariable("signal_" + std::to_string(i), 30));
+    }
+
+    Eigen::VectorXd values(30);
+
+    const int n_samples = duration * rate;
+    auto period = std::chrono::nanoseconds(1000000000 / rate);
+    auto wakeup = std::chrono::steady_clock::now();
+
+    for( int k = 0; k < n_samples; k++ )
+    {
+        for( int i = 0; i < n_vars; i++ ){
+            values.setRandom();
+            logger->add(handles[i], values);
+        }
+
+        wakeup += period;
+        std::this_thread::sleep_until(wakeup);
+    }
+
+    logger->flush();
+
+    uint64_t dropped = logger->getDroppedSamples();
+
+    std::cout << "Logged " << n_samples << " samples of " << n_vars << " variables, " << dropped << " dropped" << std::endl;
+
+    return dropped == 0 ? 0 : 1;
+
+}
@@ -27,6 +27,18 @@
 
 #include <unordered_map>
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <type_traits>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 
 #include <eigen3/Eigen/Dense>
 
@@ -38,6 +50,7 @@
 #include <matio.h>
 
 #include <XBotLogger/RtLog.hpp>
+#include <XBotLogger/utils/XBotUtils.h>
 
 #define ASYNC_QUEUE_SIZE_BIT 65536
 
@@ -49,6 +62,117 @@ namespace XBot {
 
 #define DEFAULT_BUFFER_SIZE 13421772 // 12.8 MB
 
+#define ARENA_ALIGNMENT 64 // buffers carved from the memory budget start on a cache line
+
+/**
+ * @brief Maps the scalar type of the logged data to the type used to store
+ * them in memory, and to the corresponding MAT class. Types which are not
+ * natively supported are stored as double.
+ */
+template <typename Scalar>
+struct MatScalarTraits {
+    typedef double StorageType;
+    static const enum matio_classes class_type = MAT_C_DOUBLE;
+    static const enum matio_types data_type = MAT_T_DOUBLE;
+    static const bool logical = false;
+};
+
+template <>
+struct MatScalarTraits<float> {
+    typedef float StorageType;
+    static const enum matio_classes class_type = MAT_C_SINGLE;
+    static const enum matio_types data_type = MAT_T_SINGLE;
+    static const bool logical = false;
+};
+
+template <>
+struct MatScalarTraits<int32_t> {
+    typedef int32_t StorageType;
+    static const enum matio_classes class_type = MAT_C_INT32;
+    static const enum matio_types data_type = MAT_T_INT32;
+    static const bool logical = false;
+};
+
+template <>
+struct MatScalarTraits<int16_t> {
+    typedef int16_t StorageType;
+    static const enum matio_classes class_type = MAT_C_INT16;
+    static const enum matio_types data_type = MAT_T_INT16;
+    static const bool logical = false;
+};
+
+template <>
+struct MatScalarTraits<uint8_t> {
+    typedef uint8_t StorageType;
+    static const enum matio_classes class_type = MAT_C_UINT8;
+    static const enum matio_types data_type = MAT_T_UINT8;
+    static const bool logical = false;
+};
+
+template <>
+struct MatScalarTraits<bool> {
+    typedef bool StorageType;
+    static const enum matio_classes class_type = MAT_C_UINT8;
+    static const enum matio_types data_type = MAT_T_UINT8;
+    static const bool logical = true;
+};
+
+/**
+ * @brief Describes a field of a record (see MatLogger::createRecord()): fields
+ * are either fixed-size Eigen matrices or arithmetic scalars.
+ */
+template <typename Field, typename Enable = void>
+struct MatRecordField {
+
+    typedef typename Field::Scalar Scalar;
+    static const int Rows = Field::RowsAtCompileTime;
+    static const int Cols = Field::ColsAtCompileTime;
+
+    static_assert(Rows != Eigen::Dynamic && Cols != Eigen::Dynamic,
+                  "Record fields must be fixed-size Eigen types or arithmetic scalars");
+
+    /**
+     * @brief Checks the size of a value, which is only known at run time for dynamic-size values.
+     */
+    template <typename Derived>
+    static bool fits(const Eigen::MatrixBase<Derived>& value)
+    {
+        static_assert((Derived::RowsAtCompileTime == Eigen::Dynamic || Derived::RowsAtCompileTime == Rows) &&
+                      (Derived::ColsAtCompileTime == Eigen::Dynamic || Derived::ColsAtCompileTime == Cols),
+                      "The size of the value does not match the one of the record field");
+
+        return value.rows() == Rows && value.cols() == Cols;
+    }
+
+    template <typename StorageType, typename Derived>
+    static void store(char * dst, const Eigen::MatrixBase<Derived>& value)
+    {
+        Eigen::Map<Eigen::Matrix<StorageType, Rows, Cols>> map((StorageType *)dst);
+        map = value.template cast<StorageType>();
+    }
+};
+
+template <typename Field>
+struct MatRecordField<Field, typename std::enable_if<std::is_arithmetic<Field>::value>::type> {
+
+    typedef Field Scalar;
+    static const int Rows = 1;
+    static const int Cols = 1;
+
+    template <typename Value>
+    static bool fits(const Value&)
+    {
+        return true;
+    }
+
+    template <typename StorageType, typename Value>
+    static void store(char * dst, const Value& value)
+    {
+        StorageType sample = value;
+        memcpy(dst, &sample, sizeof(sample));
+    }
+};
+
 /**
  * @brief The MatLogger class provides functionality to log numerical
  * data to binary .mat files which can be easily imported in MATLAB/
@@ -61,16 +185,411 @@ namespace XBot {
  * variables to be logged (not mandatory, but makes the logger RT
  * safe) with methods createScalarVariable(), createVectorVariable(),
  * createMatrixVariable()
- *  - inside the loop, log data with the method add()
+ *  - inside the loop, log data with the method add(); passing the handle
+ * returned by the createXXXVariable() methods instead of the variable name
+ * avoids the lookup by name
  *  - you can actually dump data to the mat file manually by calling flush(),
  *    otherwise the dumping will be done inside the destructor
+ *  - for long runs, call startStreaming() before creating any variable: a
+ *    background thread will then move data to disk while logging, so
+ *    that memory usage stays bounded; very long runs can be split into several
+ *    files (see startStreaming()), which are joined by xbot_mat_merge
+ *  - signals which are logged together at every iteration can be grouped
+ *    into a record (see createRecord()), which is logged by a single add()
+ *  - to align variables in time, call enableTimestamps() before creating any
+ *    variable and tick() once per iteration: a <name>_time vector is then
+ *    written for each variable
+ *  - to log from RT threads while other threads use the logger, create all
+ *    variables first, then one Producer per RT thread (see createProducer())
+ *  - to keep the data of runs which end with a crash, call enableCrashRecovery()
+ *    before creating any variable, and run xbot_mat_recover after the crash
+ *  - to save the data of runs which are interrupted by a signal, call
+ *    installSignalHandlers() once at startup
  *
  */
 class MatLogger {
 
 
+public: enum class VariableType { Scalar, Vector, Matrix, Record };
+
+protected: struct VariableInfo;
+
+public:
+
+    /**
+     * @brief Lightweight handle to a variable which has been preallocated
+     * by one of the createScalarVariable(), createVectorVariable(),
+     * createMatrixVariable() methods. Logging through a handle skips the
+     * lookup by name, and is therefore the preferred way of calling add()
+     * inside high-frequency loops.
+     *
+     * A default-constructed handle is invalid; handles convert implicitly to
+     * false when the corresponding create method has failed, so that code
+     * written when these methods returned bool (if( !logger->createVectorVariable(...) ),
+     * bool ok = logger->createVectorVariable(...), ok &= ...) keeps compiling
+     * with the same meaning. A handle points to the variable itself, which is
+     * never moved: creating other variables does not invalidate it.
+     */
+    template <VariableType Type>
+    class VariableHandle {
+
+    public:
+
+        friend class MatLogger;
+
+        VariableHandle(): _idx(-1), _var(nullptr) {}
+
+        bool valid() const { return _var != nullptr; }
+
+        operator bool() const { return valid(); }
+
+    private:
+
+        VariableHandle(int idx, VariableInfo * var): _idx(idx), _var(var) {}
+
+        int _idx;
+        VariableInfo * _var;
+
+    };
+
+    typedef VariableHandle<VariableType::Scalar> ScalarHandle;
+    typedef VariableHandle<VariableType::Vector> VectorHandle;
+    typedef VariableHandle<VariableType::Matrix> MatrixHandle;
+
+    /**
+     * @brief Handle to a record, i.e. a group of fixed-size fields which are
+     * stored as a single row of one circular buffer and logged by a single
+     * call to add() (see createRecord()).
+     */
+    template <typename... Fields>
+    class RecordHandle {
+
+    public:
+
+        friend class MatLogger;
+
+        RecordHandle(): _idx(-1), _var(nullptr) {}
+
+        bool valid() const { return _var != nullptr; }
+
+        explicit operator bool() const { return valid(); }
+
+    private:
+
+        RecordHandle(int idx, VariableInfo * var): _idx(idx), _var(var) {}
+
+        int _idx;
+        VariableInfo * _var;
+
+    };
+
+    /**
+     * @brief Handle to a variable whose samples have a type known at compile time
+     * (see createFixedVariable()): add() stores them without checking their size
+     * and without selecting the storage type at run time.
+     */
+    template <typename Sample>
+    class FixedHandle {
+
+    public:
+
+        friend class MatLogger;
+
+        FixedHandle(): _idx(-1), _var(nullptr) {}
+
+        bool valid() const { return _var != nullptr; }
+
+        explicit operator bool() const { return valid(); }
+
+    private:
+
+        FixedHandle(int idx, VariableInfo * var): _idx(idx), _var(var) {}
+
+        int _idx;
+        VariableInfo * _var;
+
+    };
+
+protected: struct ProducerQueue;
+
+public:
+
+    /**
+     * @brief RT safe front-end of a MatLogger, to be used by a single thread
+     * (see createProducer()). Samples are converted to their storage type and
+     * pushed to a wait-free single-producer/single-consumer queue, which is
+     * emptied by a background thread of the logger; the producer thread
+     * never touches the internals of the logger.
+     *
+     * When the queue is full, samples are discarded and add() returns false.
+     */
+    class Producer {
+
+    public:
+
+        friend class MatLogger;
+
+        Producer(): _logger(nullptr), _queue(nullptr) {}
+
+        bool valid() const { return _queue != nullptr; }
+
+        explicit operator bool() const { return valid(); }
+
+        /**
+         * @brief Queues a sample of the variable pointed by the provided handle.
+         *
+         * @return True if the sample has been queued.
+         */
+        template <VariableType Type, typename Derived>
+        bool add(VariableHandle<Type> handle, const Eigen::MatrixBase<Derived>& data)
+        {
+            char * payload = reserve(handle._idx);
+
+            if( !payload ){
+                return false;
+            }
+
+            const SampleLayout& layout = _queue->layouts[handle._idx];
+
+            if( data.rows() != layout.rows || data.cols() != layout.cols ){
+                return false;
+            }
+
+            store_sample(payload, layout.class_type, layout.logical, data);
+
+            commit();
+
+            return true;
+        }
+
+        bool add(ScalarHandle handle, double data)
+        {
+            Eigen::Matrix<double, 1, 1> eigen_data;
+            eigen_data(0) = data;
+            return add(handle, eigen_data);
+        }
+
+        /**
+         * @brief Queues a sample of the record pointed by the provided handle.
+         *
+         * @return True if the sample has been queued.
+         */
+        template <typename... Fields, typename... Values>
+        bool add(RecordHandle<Fields...> handle, const Values&... values)
+        {
+            static_assert(sizeof...(Fields) == sizeof...(Values), "The number of values must match the number of fields of the record");
+
+            if( !check_fields(FieldList<Fields...>(), values...) ){
+                return false;
+            }
+
+            char * payload = reserve(handle._idx);
+
+            if( !payload ){
+                return false;
+            }
+
+            store_fields(FieldList<Fields...>(), payload, values...);
+
+            commit();
+
+            return true;
+        }
+
+        /**
+         * @brief Queues a sample of the variable pointed by the provided handle.
+         *
+         * @return True if the sample has been queued.
+         */
+        template <typename Sample, typename Value>
+        bool add(FixedHandle<Sample> handle, const Value& value)
+        {
+            typedef MatRecordField<Sample> Field;
+            typedef typename MatScalarTraits<typename Field::Scalar>::StorageType StorageType;
+
+            if( !Field::fits(value) ){
+                return false;
+            }
+
+            char * payload = reserve(handle._idx);
+
+            if( !payload ){
+                return false;
+            }
+
+            Field::template store<StorageType>(payload, value);
+
+            commit();
+
+            return true;
+        }
+
+        /**
+         * @brief Number of samples which have been discarded because the queue was full.
+         */
+        uint64_t getDroppedSamples() const;
+
+        /**
+         * @brief Maximum number of samples which have been waiting inside the queue.
+         */
+        uint64_t getHighWaterMark() const;
+
+    private:
+
+        Producer(MatLogger * logger, ProducerQueue * queue): _logger(logger), _queue(queue) {}
+
+        char * reserve(int idx);
+
+        void commit();
+
+        MatLogger * _logger;
+        ProducerQueue * _queue;
+
+    };
+
+    /**
+     * @brief Format of the output file. MAT v5 files are smaller to write
+     * and read, but cannot hold variables larger than 2 GB. MAT v7.3 files
+     * are HDF5 files which MATLAB, h5py, ... can read partially; in streaming
+     * mode, data are appended to chunked datasets with an unlimited time dimension.
+     */
+    enum class FileFormat { MAT5, MAT73 };
+
+    /**
+     * @brief Compression applied to variables when they are written to disk.
+     * MAT73 files only distinguish between None and compressed (zlib, fixed level).
+     */
+    enum class Compression {
+        None,       // fastest dump, largest file
+        Fast,       // zlib level 1
+        Default,    // zlib default level
+        Best        // zlib level 9, smallest file
+    };
+
+    /**
+     * @brief Statistics about a variable written by the last flush().
+     */
+    struct VariableStats {
+        std::string name;
+        Compression compression = Compression::Default;
+        std::size_t raw_bytes = 0;      // size of the uncompressed variable
+        std::size_t file_bytes = 0;     // size of the variable inside the file, if file_bytes_known
+        bool file_bytes_known = false;  // false for MAT73, whose storage is laid out by HDF5
+        double time = 0;                // seconds spent compressing and writing the variable
+    };
+
+    /**
+     * @brief Statistics which can be stored for each window of a decimated
+     * variable, see setDecimation().
+     */
+    enum class Aggregation {
+        Mean,       // written as <name>_mean
+        Min,        // written as <name>_min
+        Max,        // written as <name>_max
+        Rms         // written as <name>_rms
+    };
+
+    /**
+     * @brief Policy applied by add() in streaming mode when the background
+     * writer falls behind and the circular buffer of a variable is full.
+     */
+    enum class OverflowPolicy {
+        DropNewest, // the new sample is discarded and add() returns false (RT safe)
+        Block       // add() waits for the writer to free some space (NOT RT safe)
+    };
+
+    /**
+     * @brief Options for the streaming mode, see startStreaming().
+     */
+    struct StreamingOptions {
+        int buffer_bytes = 1024*1024;   // memory allocated for the circular buffer of each variable
+        int chunks_per_buffer = 8;      // data are written to disk as soon as a chunk has been filled
+        int period_ms = 10;             // period of the background writer thread
+        OverflowPolicy overflow_policy = OverflowPolicy::DropNewest;
+        std::size_t segment_bytes = 0;  // if > 0, a new file is started after this amount of streamed data
+        int segment_seconds = 0;        // if > 0, a new file is started after this time
+    };
+
+protected: struct StreamState {
+
+    std::atomic<uint64_t> written{0};   // samples written by add()
+    std::atomic<uint64_t> drained{0};   // samples moved to disk by the writer thread
+    std::atomic<uint64_t> dropped{0};   // samples discarded because of an overflow
+    uint64_t dropped_reported = 0;
+    uint64_t spooled = 0;               // samples stored inside the spool file
+    std::string spool_file;
+    int fd = -1;
+    uint64_t time_spooled = 0;          // timestamps stored inside the time spool file
+    std::string time_file;
+    int time_fd = -1;
+
+};
+
+protected: struct CompressedRing {
+
+    int block_bytes;                    // each block starts with its number of samples (uint32)
+    int n_blocks;
+    int first_block = 0;                // oldest block
+    int used_blocks = 0;
+    uint32_t bit_pos = 0;               // next bit to be written inside the current block
+    uint32_t prev_tick = 0;
+    std::vector<uint64_t> prev;         // previous value of each element
+    std::vector<uint8_t> leading;       // meaningful bits window of the previous XOR of each element
+    std::vector<uint8_t> trailing;
+
+};
+
+protected: struct FieldInfo {
+
+    std::string name;
+    VariableType type;
+    enum matio_classes class_type;
+    enum matio_types data_type;
+    bool logical;
+    int rows, cols;
+    int offset;     // position of the field inside a record sample, in bytes
+    int bytes;
+
+};
+
+protected: struct SampleLayout {
+
+    enum matio_classes class_type;
+    bool logical;
+    int rows, cols;
+    int sample_bytes;
+
+};
+
+protected: struct ProducerQueue {
+
+    struct SlotHeader {
+        int var;            // index of the variable
+        uint32_t tick;      // timestamp index at the time of add() (see tick())
+    };
+
+    std::vector<SampleLayout> layouts;  // variables known when the producer was created
+    int slot_bytes;                     // header followed by the largest sample, 8-byte aligned
+    int capacity;
+    std::shared_ptr<char> slots;
+    std::atomic<uint64_t> pushed{0};
+    std::atomic<uint64_t> popped{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> high_water{0};
+
+};
+
+protected: struct RingHeader {
+
+    char magic[8];                      // RING_MAGIC or TIME_MAGIC
+    uint32_t version;
+    uint32_t header_bytes;              // offset of the samples inside the file (page aligned)
+    uint32_t desc_bytes;                // size of the description which follows the header
+    uint32_t crc;                       // CRC32C of the fields above and of the description
+    std::atomic<uint64_t> written;      // samples written so far (not covered by the CRC)
+    std::atomic<uint32_t> tick;         // time track only: last tick (not covered by the CRC)
 
-protected: enum class VariableType { Scalar, Vector, Matrix };
+};
 
 protected: struct VariableInfo {
 
@@ -78,45 +597,63 @@ protected: struct VariableInfo {
     int interleave = 1;
     int count = 0;
     VariableType type;
-    Eigen::MatrixXd data;
+    enum matio_classes class_type;
+    enum matio_types data_type;
+    bool logical;
+    int sample_bytes;
+    std::shared_ptr<char> data;
     int rows, cols;
-    int buffer_capacity;
+    int buffer_capacity;                // zero until allocateBuffers() when the depth is decided by the memory budget
+    bool unallocated_reported = false;  // add() has been called before allocateBuffers()
+    int default_capacity = 0;
     int head = 0, tail = 0;
     bool empty = true;
+    Compression compression = Compression::Default;
+    bool compression_override = false;
+    std::unique_ptr<StreamState> stream;
+    std::unique_ptr<CompressedRing> compressed;     // see setCompressedStorage()
+    std::vector<FieldInfo> fields;      // only for records
+    std::shared_ptr<uint32_t> ticks;    // index of the timestamp of each sample (see tick())
+    std::atomic<uint64_t> * ring_written = nullptr;    // inside the ring file (see enableCrashRecovery())
+    std::vector<char> header;                           // ring file header, kept for the emergency dump
+    std::atomic<bool> writing{false};   // a sample is being written (see WriteScope)
+
+    std::vector<Aggregation> aggregations;  // one field per statistic (see setDecimation())
+    int window = 1;
+    int window_count = 0;
+    Eigen::ArrayXXd acc_sum, acc_squares, acc_min, acc_max;
 
-    void rearrange()
+    /**
+     * @brief Moves the samples to the beginning of the buffer, in chronological
+     * order (oldest first). Wrapped buffers are rotated in place, in O(n) time
+     * and without any temporary copy.
+     *
+     * @return The number of samples inside the buffer
+     */
+    int rearrange()
     {
 
         if( empty ){
-            data.resize(0,0);
-            return;
+            return 0;
         }
 
+        // head is always zero until the buffer wraps for the first time
         if( tail > head ){
-            data.conservativeResize(data.rows(), cols*(tail-head));
-            return;
+            return tail - head;
         }
 
-        Logger::warning() << "Data of " << name << " are circ-shifted, take care while reading it" << Logger::endl();
+        char * begin = data.get();
 
-//         Eigen::MatrixXd tmp(data.rows(), data.cols());
-//         tmp.leftCols(cols*(buffer_capacity-head)) = data.rightCols(cols*(buffer_capacity-head));
-//         tmp.rightCols(cols*head) = data.leftCols(cols*head);
-//         data = tmp;
+        std::rotate(begin, begin + (size_t)head*sample_bytes, begin + (size_t)buffer_capacity*sample_bytes);
 
-//         for( int i = 0; i < (buffer_capacity-tail)*cols; i++ ){
-//             auto log = XBot::ConsoleLogger::getLogger();
-//             log->info() << "Data of " << name << " are circ-shifted, take care!from circular array...be patient! [TBD improve performance]" << log->endl();
-//             circshift();
-//         }
-    }
+        if( ticks ){
+            std::rotate(ticks.get(), ticks.get() + head, ticks.get() + buffer_capacity);
+        }
 
-private:
+        head = 0;
+        tail = buffer_capacity;
 
-    void circshift(){
-        for( int i = 1; i < data.cols(); i++){
-            data.col(i).swap(data.col(0));
-        }
+        return buffer_capacity;
     }
 
 };
@@ -129,22 +666,41 @@ public:
      * @brief Factory method which returns a matlogger which
      * saves on the mat file provided as an argument.
      *
+     * Safe to call concurrently from several threads. Looking up an existing
+     * logger is wait-free (it reads an immutable snapshot of the registry),
+     * while creating a new one is serialized by a mutex.
+     *
      * @return A shared pointer to the requested MatLogger
      */
     static Ptr getLogger(std::string filename)
     {
-        if( _instances.count(filename) ){
-            return _instances.at(filename);
-        }
-        else{
-            _instances[filename] = Ptr(new MatLogger(filename));
-            return _instances.at(filename);
+        const Registry * registry = _registry.load(std::memory_order_acquire);
+
+        if( registry ){
+
+            auto it = registry->find(filename);
+
+            if( it != registry->end() ){
+                return it->second;
+            }
         }
+
+        return register_logger(filename);
     }
     
     
+    /**
+     * @brief Flushes all the loggers created so far. Can run concurrently
+     * with getLogger().
+     */
     static void FlushAll() {
-        for(auto pair: _instances){
+        const Registry * registry = _registry.load(std::memory_order_acquire);
+
+        if( !registry ){
+            return;
+        }
+
+        for(auto pair: *registry){
             pair.second->flush();
         }
     }
@@ -192,184 +748,478 @@ public:
     /**
      * @brief Allocate memory for logging a scalar variable.
      *
+     * @tparam Scalar The type used to store the samples (double, float, int32_t, int16_t,
+     * uint8_t or bool); other types are stored as double.
      * @param name The name of the variable to be logged.
      * @param interleave The variable will be actually logged every interleave calls to the method add() (default is 1)
      * @param buffer_size Max number of samples that will be logged before overwriting the oldest ones (default one million)
-     * @return True if the requested name is available.
+     * @return A valid handle if the requested name is available, an invalid one otherwise.
      */
-    bool createScalarVariable(std::string name, int interleave = 1, int buffer_size = -1)
+    template <typename Scalar = double>
+    ScalarHandle createScalarVariable(std::string name, int interleave = 1, int buffer_size = -1)
     {
-        if( buffer_size < 0 ){
-            buffer_size = 1024*1024;
-        }
+        typedef typename MatScalarTraits<Scalar>::StorageType StorageType;
+
+        int default_size = _streaming ? default_stream_buffer_size(sizeof(StorageType)) : 1024*1024;
 
         if(_var_idx_map.count(name) || _single_var_map.count(name)){
-            return false;
+            return ScalarHandle();
         }
 
-        _var_idx_map[name] = VariableInfo();
+        if( !plan_buffer(name, sizeof(StorageType), default_size, buffer_size) ){
+            return ScalarHandle();
+        }
 
-        VariableInfo& varinfo = _var_idx_map.at(name);
+        VariableInfo& varinfo = create_variable(name);
 
-        varinfo.name = name;
         varinfo.interleave = interleave;
         varinfo.count = -1;
         varinfo.type = VariableType::Scalar;
-        varinfo.data = Eigen::RowVectorXd::Zero(buffer_size);
         varinfo.rows = 1;
         varinfo.cols = 1;
         varinfo.buffer_capacity = buffer_size;
+        varinfo.default_capacity = default_size;
+        if( !init_storage<Scalar>(varinfo) ){
+            discard_variable();
+            return ScalarHandle();
+        }
 
-
-        return true;
+        return ScalarHandle(_var_idx_map.at(name), &varinfo);
 
     }
 
     /**
-     * @brief Allocate memory for logging a scalar variable.
+     * @brief Allocate memory for logging a vector variable.
      *
+     * @tparam Scalar The type used to store the samples (double, float, int32_t, int16_t,
+     * uint8_t or bool); other types are stored as double.
      * @param name The name of the variable to be logged.
      * @param size The size of the vector to be logged (i.e. its number of elements)
      * @param interleave The variable will be actually logged every interleave calls to the method add() (default is 1)
      * @param buffer_size Max number of samples that will be logged before overwriting the oldest ones (by default 12.8 MB of memory are allocated)
-     * @return True if the requested name is available.
+     * @return A valid handle if the requested name is available, an invalid one otherwise.
      */
-    bool createVectorVariable(std::string name, int size, int interleave = 1, int buffer_size = -1)
+    template <typename Scalar = double>
+    VectorHandle createVectorVariable(std::string name, int size, int interleave = 1, int buffer_size = -1)
     {
+        typedef typename MatScalarTraits<Scalar>::StorageType StorageType;
+
         if( size <= 0 ){
-            return false;
+            return VectorHandle();
         }
 
-        if( buffer_size < 0 ){
-            buffer_size = DEFAULT_BUFFER_SIZE / (size * 8);
-        }
+        int default_size = _streaming ? default_stream_buffer_size(size * sizeof(StorageType)) : DEFAULT_BUFFER_SIZE / (size * sizeof(StorageType));
 
         if(_var_idx_map.count(name)){
-            return false;
+            return VectorHandle();
         }
 
-        _var_idx_map[name] = VariableInfo();
+        if( !plan_buffer(name, size * sizeof(StorageType), default_size, buffer_size) ){
+            return VectorHandle();
+        }
 
-        VariableInfo& varinfo = _var_idx_map.at(name);
+        VariableInfo& varinfo = create_variable(name);
 
-        varinfo.name = name;
         varinfo.interleave = interleave;
         varinfo.count = 0;
         varinfo.type = VariableType::Vector;
-        varinfo.data = Eigen::MatrixXd::Zero(size, buffer_size);
         varinfo.rows = size;
         varinfo.cols = 1;
         varinfo.buffer_capacity = buffer_size;
+        varinfo.default_capacity = default_size;
+        if( !init_storage<Scalar>(varinfo) ){
+            discard_variable();
+            return VectorHandle();
+        }
 
-
-        return true;
+        return VectorHandle(_var_idx_map.at(name), &varinfo);
     }
 
     /**
-     * @brief Allocate memory for logging a scalar variable.
+     * @brief Allocate memory for logging a matrix variable.
      *
+     * @tparam Scalar The type used to store the samples (double, float, int32_t, int16_t,
+     * uint8_t or bool); other types are stored as double.
      * @param name The name of the variable to be logged.
      * @param rows The number of rows of the vector to be logged
      * @param cols The number of columns of the vector to be logged
      * @param interleave The variable will be actually logged every interleave calls to the method add() (default is 1)
      * @param buffer_size Max number of samples that will be logged before overwriting the oldest ones (by default 12.8 MB of memory are allocated)
-     * @return True if the requested name is available.
+     * @return A valid handle if the requested name is available, an invalid one otherwise.
      */
-    bool createMatrixVariable(std::string name, int rows, int cols, int interleave = 1, int buffer_size = -1)
+    template <typename Scalar = double>
+    MatrixHandle createMatrixVariable(std::string name, int rows, int cols, int interleave = 1, int buffer_size = -1)
     {
+        typedef typename MatScalarTraits<Scalar>::StorageType StorageType;
 
         if( rows <= 0 || cols <= 0 ){
-            return false;
+            return MatrixHandle();
         }
 
-        if( buffer_size < 0 ){
-            buffer_size = DEFAULT_BUFFER_SIZE / (rows * cols * 8);
-        }
+        int default_size = _streaming ? default_stream_buffer_size(rows * cols * sizeof(StorageType)) : DEFAULT_BUFFER_SIZE / (rows * cols * sizeof(StorageType));
 
         if(_var_idx_map.count(name)){
-            return false;
+            return MatrixHandle();
         }
 
+        if( !plan_buffer(name, rows * cols * sizeof(StorageType), default_size, buffer_size) ){
+            return MatrixHandle();
+        }
 
-        _var_idx_map[name] = VariableInfo();
 
-        VariableInfo& varinfo = _var_idx_map.at(name);
+        VariableInfo& varinfo = create_variable(name);
 
-        varinfo.name = name;
         varinfo.interleave = interleave;
         varinfo.count = -1;
         varinfo.type = VariableType::Matrix;
-        varinfo.data = Eigen::MatrixXd::Zero(rows, cols*buffer_size);
         varinfo.rows = rows;
         varinfo.cols = cols;
         varinfo.buffer_capacity = buffer_size;
+        varinfo.default_capacity = default_size;
+        if( !init_storage<Scalar>(varinfo) ){
+            discard_variable();
+            return MatrixHandle();
+        }
 
-
-        return true;
+        return MatrixHandle(_var_idx_map.at(name), &varinfo);
     }
 
-
     /**
-     * @brief Logs the provided data to the MAT variable with the provided name.
-     * If such a variable was not defined by calling a createVariable() method,
-     * the call to add() causes memory allocation and is not RT safe.
+     * @brief Allocate memory for logging a variable whose samples have a type known
+     * at compile time, i.e. a fixed-size Eigen matrix or an arithmetic scalar. The
+     * variable is a scalar, vector or matrix variable stored with the native type
+     * corresponding to the scalar of the sample; logging through the returned
+     * handle needs neither a size check nor a run-time selection of the storage type.
      *
-     * @param name MAT variable name.
-     * @param data The Eigen varible to be logged.
-     * @return True if
+     * Example:
+     *      auto handle = logger->createFixedVariable<Eigen::Vector3d>("pos");
+     *      logger->add(handle, pos);
+     *
+     * @tparam Sample The type of the samples.
+     * @param name The name of the variable to be logged.
+     * @param interleave The variable will be actually logged every interleave calls to the method add() (default is 1)
+     * @param buffer_size Max number of samples that will be logged before overwriting the oldest ones (by default 12.8 MB of memory are allocated)
+     * @return A valid handle if the requested name is available, an invalid one otherwise.
      */
-    template <typename Derived>
-    bool add(const std::string& name, const Eigen::MatrixBase<Derived>& data, int interleave = 1, int buffer_capacity = -1)
+    template <typename Sample>
+    FixedHandle<Sample> createFixedVariable(std::string name, int interleave = 1, int buffer_size = -1)
     {
-        auto it = _var_idx_map.find(name);
-
-        if( it == _var_idx_map.end() ){
+        typedef MatRecordField<Sample> Field;
+        typedef typename Field::Scalar Scalar;
 
-            if( data.cols() == 1 ){
-                if(createVectorVariable(name, data.size(), interleave, buffer_capacity)){
-                    return add(name, data);
-                }
-                else return false;
-            }
-            else{
-                if(createMatrixVariable(name, data.rows(), data.cols(), interleave, buffer_capacity)){
-                    return add(name, data);
-                }
-                else return false;
-            }
+        if( Field::Rows == 1 && Field::Cols == 1 ){
+            auto handle = createScalarVariable<Scalar>(name, interleave, buffer_size);
+            return FixedHandle<Sample>(handle._idx, handle._var);
+        }
 
+        if( Field::Cols == 1 ){
+            auto handle = createVectorVariable<Scalar>(name, Field::Rows, interleave, buffer_size);
+            return FixedHandle<Sample>(handle._idx, handle._var);
         }
 
-        VariableInfo& varinfo = it->second;
+        auto handle = createMatrixVariable<Scalar>(name, Field::Rows, Field::Cols, interleave, buffer_size);
+        return FixedHandle<Sample>(handle._idx, handle._var);
+    }
 
-        if( data.rows() != varinfo.rows || data.cols() != varinfo.cols ){
-            Logger::warning() << " in " << __func__ << "! Provided data for variable " << name << " has unmatching dimensions!\n"
-             << "Rows: " << data.rows() << " != " << varinfo.rows << "\n"
-             << "Columns: " << data.cols() <<" != " << varinfo.cols<< Logger::endl();
+    /**
+     * @brief Allocate memory for logging a record, i.e. a group of signals which
+     * are logged together. The fields of a record are stored contiguously as a
+     * single row of one circular buffer, and are all logged by a single call to
+     * add(); each field is written to the mat file as a separate variable.
+     *
+     * Example:
+     *      auto handle = logger->createRecord<Eigen::Vector3d, Eigen::Matrix3f, double>({"pos", "rot", "time"});
+     *      logger->add(handle, pos, rot, time);
+     *
+     * @tparam Fields Types of the fields, which must be fixed-size Eigen matrices or
+     * arithmetic scalars; each field is stored with the native type corresponding to its scalar.
+     * @param names The names of the fields (i.e. of the variables inside the mat file).
+     * @param interleave The record will be actually logged every interleave calls to the method add() (default is 1)
+     * @param buffer_size Max number of samples that will be logged before overwriting the oldest ones (by default 12.8 MB of memory are allocated)
+     * @return A valid handle if all of the requested names are available, an invalid one otherwise.
+     */
+    template <typename... Fields>
+    RecordHandle<Fields...> createRecord(const std::vector<std::string>& names, int interleave = 1, int buffer_size = -1)
+    {
+        static_assert(sizeof...(Fields) > 0, "A record must have at least one field");
+
+        if( names.size() != sizeof...(Fields) ){
+            return RecordHandle<Fields...>();
+        }
+
+        for( unsigned int i = 0; i < names.size(); i++ ){
+            if( _var_idx_map.count(names[i]) || _single_var_map.count(names[i]) ||
+                std::find(names.begin(), names.begin() + i, names[i]) != names.begin() + i ){
+                return RecordHandle<Fields...>();
+            }
+        }
+
+        std::vector<FieldInfo> fields;
+        describe_fields(FieldList<Fields...>(), names.data(), 0, fields);
+
+        int sample_bytes = fields.back().offset + fields.back().bytes;
+
+        int default_size = _streaming ? default_stream_buffer_size(sample_bytes) : std::max(DEFAULT_BUFFER_SIZE / sample_bytes, 1);
+
+        if( !plan_buffer(names[0], sample_bytes, default_size, buffer_size) ){
+            return RecordHandle<Fields...>();
+        }
+
+        VariableInfo& varinfo = create_variable(names[0]);
+        int idx = _var_idx_map.at(names[0]);
+
+        // every field name points to the record, so that names stay unique
+        for( unsigned int i = 1; i < names.size(); i++ ){
+            _var_idx_map[names[i]] = idx;
+        }
+
+        varinfo.interleave = interleave;
+        varinfo.count = -1;
+        varinfo.type = VariableType::Record;
+        varinfo.rows = 1;
+        varinfo.cols = 1;
+        varinfo.buffer_capacity = buffer_size;
+        varinfo.default_capacity = default_size;
+        varinfo.fields = fields;
+        varinfo.class_type = MAT_C_UINT8;
+        varinfo.data_type = MAT_T_UINT8;
+        varinfo.logical = false;
+        varinfo.sample_bytes = sample_bytes;
+        if( !allocate_storage(varinfo) ){
+            discard_variable();
+            return RecordHandle<Fields...>();
+        }
+
+        return RecordHandle<Fields...>(idx, &varinfo);
+    }
+
+
+    /**
+     * @brief Logs the provided data to the MAT variable with the provided name.
+     * If such a variable was not defined by calling a createVariable() method,
+     * the call to add() causes memory allocation and is not RT safe.
+     *
+     * @param name MAT variable name.
+     * @param data The Eigen varible to be logged.
+     * @return True if data has been logged (or skipped because of the interleave)
+     */
+    template <typename Derived>
+    bool add(const std::string& name, const Eigen::MatrixBase<Derived>& data, int interleave = 1, int buffer_capacity = -1)
+    {
+        auto it = _var_idx_map.find(name);
+
+        if( it == _var_idx_map.end() ){
+
+            if( data.cols() == 1 ){
+                auto handle = createVectorVariable<typename Derived::Scalar>(name, data.size(), interleave, buffer_capacity);
+                if(handle){
+                    return add_sample(*handle._var, data);
+                }
+                else return false;
+            }
+            else{
+                auto handle = createMatrixVariable<typename Derived::Scalar>(name, data.rows(), data.cols(), interleave, buffer_capacity);
+                if(handle){
+                    return add_sample(*handle._var, data);
+                }
+                else return false;
+            }
+
+        }
+
+        // fields of a record (or of a decimated variable) can only be logged through the variable
+        if( _vars[it->second].type == VariableType::Record || _vars[it->second].name != name ){
             return false;
         }
 
+        return add_sample(_vars[it->second], data);
 
-        varinfo.count = (varinfo.count + 1) % varinfo.interleave;
+    }
 
-        if( varinfo.count != 0 ){
-            return true;
+    /**
+     * @brief Logs the provided data to the MAT variable pointed by the provided handle.
+     * No lookup by name is performed, so that this is the fastest way of logging data.
+     *
+     * @param handle Handle returned by one of the createVariable() methods.
+     * @param data The Eigen varible to be logged.
+     * @return True if data has been logged (or skipped because of the interleave)
+     */
+    template <VariableType Type, typename Derived>
+    bool add(VariableHandle<Type> handle, const Eigen::MatrixBase<Derived>& data)
+    {
+        static_assert(Type != VariableType::Scalar || (Derived::RowsAtCompileTime <= 1 && Derived::ColsAtCompileTime <= 1),
+                      "A scalar variable can only log 1x1 data");
+        static_assert(Type != VariableType::Vector || Derived::ColsAtCompileTime <= 1,
+                      "A vector variable can only log column vectors");
+
+        if( !handle._var ){
+            return false;
         }
 
-        varinfo.tail = varinfo.tail % varinfo.buffer_capacity;
+        return add_sample(*handle._var, data);
+    }
 
-        // if buffer is not empty and head = tail, increment head since we are going to overwrite an element
-        if( !varinfo.empty && varinfo.head == varinfo.tail ){
-            varinfo.head = (varinfo.head + 1) % varinfo.buffer_capacity;
+    /**
+     * @brief Logs a sample stored in a plain buffer (column-major for matrix
+     * variables) to the MAT variable pointed by the provided handle.
+     *
+     * @param handle Handle returned by one of the createVariable() methods.
+     * @param data Pointer to the elements of the sample
+     * @param size Number of elements of the sample (must match the size of the variable)
+     * @return True if data has been logged (or skipped because of the interleave)
+     */
+    template <VariableType Type, typename Scalar>
+    bool add(VariableHandle<Type> handle, const Scalar * data, int size)
+    {
+        if( !handle._var ){
+            return false;
         }
 
-        // write to tail position
-        varinfo.data.block(0,varinfo.tail*varinfo.cols,varinfo.rows,varinfo.cols) = data.template cast<double>();
-        varinfo.empty = false;
+        VariableInfo& varinfo = *handle._var;
 
-        // increment tail position
-        varinfo.tail = (varinfo.tail + 1);
+        if( size != varinfo.rows * varinfo.cols ){
+            Logger::warning() << " in " << __func__ << "! Provided data for variable " << varinfo.name << " has unmatching size!\n"
+             << "Size: " << size << " != " << varinfo.rows * varinfo.cols << Logger::endl();
+            return false;
+        }
+
+        Eigen::Map<const Eigen::Matrix<Scalar, -1, -1>> map(data, varinfo.rows, varinfo.cols);
+
+        return add_sample(varinfo, map);
+    }
+
+    /**
+     * @brief Logs a burst of samples with a single call: each column of data
+     * (or each group of cols columns, for a matrix variable) is one sample.
+     * The interleave is applied as if add() was called once per sample, and the
+     * samples are copied to the circular buffer with at most two block copies.
+     *
+     * @param name The name of an existing variable (not a record).
+     * @param data The samples, side by side.
+     * @return True if data has been logged (or skipped because of the interleave)
+     */
+    template <typename Derived>
+    bool addBatch(const std::string& name, const Eigen::MatrixBase<Derived>& data)
+    {
+        auto it = _var_idx_map.find(name);
+
+        if( it == _var_idx_map.end() || _vars[it->second].type == VariableType::Record || _vars[it->second].name != name ){
+            return false;
+        }
+
+        return add_batch(_vars[it->second], data);
+    }
+
+    /**
+     * @brief Logs a burst of samples to the MAT variable pointed by the
+     * provided handle (see addBatch(const std::string&, const Eigen::MatrixBase<Derived>&)).
+     */
+    template <VariableType Type, typename Derived>
+    bool addBatch(VariableHandle<Type> handle, const Eigen::MatrixBase<Derived>& data)
+    {
+        if( !handle._var ){
+            return false;
+        }
+
+        return add_batch(*handle._var, data);
+    }
+
+    /**
+     * @brief Logs all of the fields of a record with a single write to its
+     * circular buffer.
+     *
+     * @param handle Handle returned by createRecord().
+     * @param values The values of the fields, in the order of the record definition;
+     * Eigen expressions are accepted as long as their size matches the one of the field.
+     * @return True if data has been logged (or skipped because of the interleave); false
+     * if the size of a (dynamic-size) value does not match the one of its field.
+     */
+    template <typename... Fields, typename... Values>
+    bool add(RecordHandle<Fields...> handle, const Values&... values)
+    {
+        static_assert(sizeof...(Fields) == sizeof...(Values), "The number of values must match the number of fields of the record");
+
+        if( !handle._var ){
+            return false;
+        }
+
+        VariableInfo& varinfo = *handle._var;
+
+        // for fixed-size values, the check folds to a constant
+        if( !check_fields(FieldList<Fields...>(), values...) ){
+            Logger::warning() << " in " << __func__ << "! Provided data for record " << varinfo.name << " has unmatching dimensions!" << Logger::endl();
+            return false;
+        }
+
+        WriteScope scope(varinfo);
+
+        int slot = reserve_slot(varinfo);
+
+        if( slot < 0 ){
+            return slot == SKIP_SAMPLE;
+        }
+
+        store_fields(FieldList<Fields...>(), varinfo.data.get() + (size_t)slot * varinfo.sample_bytes, values...);
+
+        commit_slot(varinfo, slot);
+
+        return true;
+    }
+
+    /**
+     * @brief Logs a sample of the variable pointed by the provided handle.
+     *
+     * @param handle Handle returned by createFixedVariable().
+     * @param value The sample; Eigen expressions are accepted as long as their size matches
+     * the one of Sample.
+     * @return True if data has been logged (or skipped because of the interleave); false
+     * if the size of a dynamic-size value does not match the one of Sample.
+     */
+    template <typename Sample, typename Value>
+    bool add(FixedHandle<Sample> handle, const Value& value)
+    {
+        typedef MatRecordField<Sample> Field;
+        typedef typename MatScalarTraits<typename Field::Scalar>::StorageType StorageType;
+
+        if( !handle._var ){
+            return false;
+        }
+
+        VariableInfo& varinfo = *handle._var;
+
+        // for fixed-size values, the check folds to a constant
+        if( !Field::fits(value) ){
+            Logger::warning() << " in " << __func__ << "! Provided data for variable " << varinfo.name << " has unmatching dimensions!" << Logger::endl();
+            return false;
+        }
+
+        // decimated and compressed variables do not store samples in a circular buffer
+        if( !varinfo.aggregations.empty() || varinfo.compressed ){
+            Eigen::Matrix<typename Field::Scalar, Field::Rows, Field::Cols> sample;
+            Field::template store<typename Field::Scalar>((char *)sample.data(), value);
+            return add_sample(varinfo, sample);
+        }
+
+        WriteScope scope(varinfo);
+
+        int slot = reserve_slot(varinfo);
+
+        if( slot < 0 ){
+            return slot == SKIP_SAMPLE;
+        }
 
+        Field::template store<StorageType>(varinfo.data.get() + (size_t)slot * varinfo.sample_bytes, value);
+
+        commit_slot(varinfo, slot);
+
+        return true;
+    }
+
+    bool add(ScalarHandle handle, double data)
+    {
+        Eigen::Matrix<double, 1, 1> eigen_data;
+        eigen_data(0) = data;
+        return add(handle, eigen_data);
     }
 
     bool add(const std::string& name, double data, int interleave = 1, int buffer_capacity = -1)
@@ -426,7 +1276,7 @@ public:
             tmp.col(i++) = vec;
         }
 
-        add(name, tmp, interleave, buffer_capacity);
+        return add(name, tmp, interleave, buffer_capacity);
 
     }
 
@@ -450,102 +1300,337 @@ public:
             tmp.col(i++) = vec;
         }
 
-        add(name, tmp, interleave, buffer_capacity);
+        return add(name, tmp, interleave, buffer_capacity);
 
     }
 
     /**
-     * @brief Does the actual work of saving data to disk. Since
-     * this is a time-consuming operation, should be done outside of
-     * any high performance loop. If not explicitly called in the code,
-     * flush() is anyway performed in the class destructor.
+     * @brief Sets the format of the output file (default is MAT5). Must be called
+     * before startStreaming() and flush(). With MAT73, the size of each variable
+     * inside the file is not available (see getFlushStats()).
+     *
+     * @return True if the file format has been changed.
      */
-    void flush(){
+    bool setFileFormat(FileFormat format);
 
-        if(_flushed) return;
+    /**
+     * @brief Enables the streaming mode: a background thread periodically
+     * moves the samples of each variable from its circular buffer to disk,
+     * so that the memory usage is fixed (see StreamingOptions::buffer_bytes)
+     * and no sample is lost as long as the writer keeps up with add().
+     * When it does not, the configured OverflowPolicy is applied and the number
+     * of discarded samples is reported.
+     *
+     * If StreamingOptions::segment_bytes or StreamingOptions::segment_seconds
+     * are set, the writer thread also rotates the output file: once either
+     * limit is reached, the data streamed so far are sealed into
+     * <file name>__part<K>.mat and a new segment is started, without pausing
+     * add(). With MAT5, segments are compressed and written by a separate
+     * thread, so that the writer keeps draining the buffers meanwhile; MAT73
+     * segments already contain their samples and are closed by the writer.
+     * Variables logged with log() are written to the last segment only.
+     * The segments can be joined by the xbot_mat_merge tool (see merge()).
+     *
+     * Must be called before any variable is created.
+     *
+     * @return True if the streaming mode has been enabled.
+     */
+    bool startStreaming();
 
-        _flushed = true;
+    bool startStreaming(const StreamingOptions& options);
 
-        Logger::info(Logger::Severity::HIGH) << "Dumping data to mat file " << _file_name << Logger::endl();
+    /**
+     * @brief Sets the default compression for all variables of this logger
+     * (default is Compression::Default).
+     */
+    void setCompression(Compression compression);
 
-        mat_t * mat_file = Mat_CreateVer(_file_name.c_str(), nullptr, MAT_FT_MAT5);
+    /**
+     * @brief Sets the compression for a single variable, overriding the
+     * logger default.
+     *
+     * @return True if a variable with the provided name exists.
+     */
+    bool setCompression(const std::string& name, Compression compression);
 
-        if(!mat_file){
-            std::cout << "ERROR creating MAT file!" << std::endl;
-        }
+    /**
+     * @brief Replaces the plain interleave of a variable with a windowed
+     * aggregation: the samples are accumulated over each window, and at the end
+     * of the window one aggregated sample is stored for each of the requested
+     * statistics (e.g. {Min, Max} for an envelope which keeps the peaks).
+     * The buffer size of the variable is then counted in windows.
+     *
+     * Must be called before the variable is logged and before any producer is
+     * created; not available for records, for variables with an interleave and for
+     * variables with compressed storage (see setCompressedStorage()).
+     *
+     * @param name The name of the variable
+     * @param window Number of samples of each window
+     * @param modes The statistics to be stored
+     * @return True if the decimation has been set.
+     */
+    bool setDecimation(const std::string& name, int window, const std::vector<Aggregation>& modes);
 
-        for( auto& pair : _single_var_map ){
+    /**
+     * @brief Stores the samples of a variable in compressed form: each element
+     * is XOR-encoded against its previous value (as in the Gorilla time series
+     * database), in constant time, into blocks of block_bytes which are decoded
+     * only by flush(). Slowly varying signals take several times less memory, so
+     * that the memory of the circular buffer covers a longer history; when it is
+     * full, the oldest block is discarded.
+     *
+     * Only available for variables stored as double. Must be called before the
+     * variable is logged and before any producer is created; not available in
+     * streaming mode, with crash recovery, with a memory budget and for decimated
+     * variables.
+     *
+     * @param name The name of the variable
+     * @param block_bytes The size of each block
+     * @return True if the compressed storage has been enabled.
+     */
+    bool setCompressedStorage(const std::string& name, int block_bytes = 4096);
 
-            Logger::info() << "Writing variable " << pair.first << " to mat file..." << Logger::endl();
+    /**
+     * @brief Enables the crash-safe backend: the circular buffer of each variable
+     * is placed inside a memory-mapped file (<file name>.rings/<index>.ring) with a
+     * small header describing it, so that data survive a crash of the process.
+     * After a crash, the mat file can be rebuilt by the xbot_mat_recover tool
+     * (see recover()). The ring files are removed by a successful flush().
+     *
+     * Storing a sample only costs an additional store of the sample counter.
+     * Variables logged with log() are not crash-safe.
+     *
+     * Must be called before any variable is created, and before enableTimestamps();
+     * not available in streaming mode and with a memory budget.
+     *
+     * @return True if the crash-safe backend has been enabled.
+     */
+    bool enableCrashRecovery();
 
-            int n_dims = 2;
-            std::size_t dims[2];
-            dims[0] = pair.second.rows();
-            dims[1] = pair.second.cols();
+    /**
+     * @brief Rebuilds a mat file from the ring files left by a crashed logger
+     * (see enableCrashRecovery()). Damaged ring files are skipped.
+     *
+     * @param ring_dir The directory containing the ring files
+     * @param mat_file The mat file to be written (by default, the one of the crashed logger)
+     * @return True if at least one variable has been recovered and written.
+     */
+    static bool recover(const std::string& ring_dir, const std::string& mat_file = "");
 
+    /**
+     * @brief Joins the segments of a rotated log (see startStreaming()) into a
+     * single mat file: each variable is concatenated along its last (time)
+     * dimension, in the order of the segments. Variables whose type or size
+     * differ from the ones of the first segment containing them are skipped.
+     * Variables are copied one segment at a time, so that memory usage is
+     * bounded by the largest variable of a single segment.
+     *
+     * @param segments The segment files, in chronological order
+     * @param mat_file The mat file to be written
+     * @return True if the mat file has been written.
+     */
+    static bool merge(const std::vector<std::string>& segments, const std::string& mat_file);
 
-            matvar_t * mat_var = Mat_VarCreate(pair.first.c_str(),
-                                               MAT_C_DOUBLE,
-                                               MAT_T_DOUBLE,
-                                               n_dims,
-                                               dims,
-                                               (void *)pair.second.data(),
-                                               0 );
+    /**
+     * @brief Installs an emergency flush of all loggers on SIGINT, SIGTERM and SIGSEGV.
+     *
+     * On SIGINT and SIGTERM, the handler wakes up a flusher thread (spawned here)
+     * which performs FlushAll(), and waits for it at most timeout_ms. On SIGSEGV,
+     * or if the flusher does not complete in time, the handler instead dumps the
+     * raw buffers with plain write() calls into <file name>.rings, which can be
+     * converted by the xbot_mat_recover tool (see recover()). The signal is then
+     * raised again with its previous disposition.
+     *
+     * Variables which the interrupted thread was writing are skipped, since their
+     * buffers might be torn; the other threads keep running, so the variables
+     * they are logging might also be caught halfway through a write.
+     * Loggers in streaming mode are only covered by the flusher thread.
+     *
+     * @param timeout_ms Maximum time the handler waits for the flusher thread
+     * @return True if the handlers have been installed.
+     */
+    static bool installSignalHandlers(int timeout_ms = 5000);
 
-            Mat_VarWrite(mat_file, mat_var, MAT_COMPRESSION_ZLIB);
-            Mat_VarFree(mat_var);
+    /**
+     * @brief Enables the shared timestamp track: every sample keeps the index
+     * of the last timestamp recorded by tick(), and flush() writes a vector
+     * <name>_time (seconds, CLOCK_MONOTONIC) for each variable, aligned with
+     * the samples which have been retained. Samples whose timestamp is not
+     * available (added before the first tick(), or older than the track) get NaN.
+     *
+     * Must be called before any variable is created.
+     *
+     * @param buffer_size Number of timestamps kept by the track (rounded up to a power of two)
+     * @return True if the timestamp track has been enabled.
+     */
+    bool enableTimestamps(int buffer_size = 1024*1024);
 
+    /**
+     * @brief Records a new timestamp on the shared track; samples added
+     * from now on (until the next tick) are associated to it. Usually
+     * called once per control loop iteration. RT safe.
+     *
+     * @param time_ns The timestamp, in nanoseconds (default is the current CLOCK_MONOTONIC time)
+     */
+    void tick(uint64_t time_ns = get_time_ns())
+    {
+        if( !_time_track ){
+            return;
         }
 
-        for( auto& pair : _var_idx_map ){
+        uint32_t tick = _tick->load(std::memory_order_relaxed) + 1;
+        tick += (tick == 0); // zero is reserved for samples without timestamp
 
-            Logger::info() << "Writing variable " << pair.first << " to mat file..." << Logger::endl();
+        // the tick counter is updated before the slot is overwritten, so that
+        // the streaming writer can detect stale timestamps (see tick_time())
+        _tick->store(tick, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        _time_track.get()[(tick - 1) & _time_mask].store(time_ns, std::memory_order_relaxed);
+    }
 
-            VariableInfo& varinfo = pair.second;
+    /**
+     * @brief How the buffers of the variables (and of the producer queues)
+     * are allocated, see setAllocationMode().
+     */
+    enum class AllocationMode {
+        Default,    // heap memory, zeroed (i.e. touched) at creation
+        Locked,     // prefaulted and locked in RAM with mlock(), so that add() never page faults
+        HugePages   // as Locked, buffers of 2 MB or more are backed by huge pages
+    };
 
-//             varinfo.rearrange();
+    /**
+     * @brief Memory used by the circular buffer of a variable (see getMemoryReport()).
+     */
+    struct VariableMemory {
+        std::string name;
+        int sample_bytes = 0;       // size of a sample (timestamp index excluded)
+        int buffer_capacity = 0;    // number of samples retained, zero if not yet allocated; for compressed storage, number of samples currently held
+        std::size_t bytes = 0;      // memory used by the buffer, timestamp indices included; for compressed storage, memory of the blocks
+    };
 
-            int n_dims = 2;
-            std::size_t dims[3];
+    /**
+     * @brief Sets how buffers are allocated (default is AllocationMode::Default).
+     * With Locked and HugePages, buffers which cannot be locked in RAM (see
+     * RLIMIT_MEMLOCK) make the creation of the variable fail. HugePages uses
+     * explicit huge pages (MAP_HUGETLB) when they are reserved, and transparent
+     * huge pages otherwise.
+     *
+     * Must be called before any variable is created, and before setMemoryBudget().
+     *
+     * @return True if the allocation mode has been changed.
+     */
+    bool setAllocationMode(AllocationMode mode);
 
-            if( varinfo.type == VariableType::Matrix ){
-                n_dims = 3;
-                dims[0] = varinfo.rows;
-                dims[1] = varinfo.cols;
-                dims[2] = (varinfo.tail > varinfo.head || varinfo.empty) ? (varinfo.tail-varinfo.head) : varinfo.data.cols()/varinfo.cols;
-            }
-            else{
-                dims[0] = varinfo.data.rows();
-                dims[1] = (varinfo.tail > varinfo.head || varinfo.empty) ? (varinfo.tail-varinfo.head) : varinfo.data.cols();
-            }
+    /**
+     * @brief Sets a memory budget for the buffers of all variables of this logger,
+     * which are then carved from a single arena of the provided size.
+     *
+     * Variables created with an explicit buffer_size are allocated immediately;
+     * those created with the default one are allocated by allocateBuffers(), which
+     * shares the remaining budget among them, so that all of them retain the same
+     * time span (the depth is inversely proportional to the interleave, and never
+     * exceeds the default one), and which must be called before logging them.
+     * Creating a variable which does not fit into the remaining budget fails up front.
+     *
+     * Must be called before any variable is created.
+     *
+     * @return True if the budget has been set.
+     */
+    bool setMemoryBudget(std::size_t bytes);
 
-            matvar_t * mat_var = Mat_VarCreate(pair.first.c_str(),
-                                               MAT_C_DOUBLE,
-                                               MAT_T_DOUBLE,
-                                               n_dims,
-                                               dims,
-                                               (void *)varinfo.data.data(),
-                                               0 );
+    /**
+     * @brief Allocates the buffers of the variables whose depth is decided by
+     * the memory budget (see setMemoryBudget()). Must be called after creating all
+     * variables and before logging them, so that the arena is never allocated and
+     * locked by an RT thread: add() to a variable whose buffer has not been allocated
+     * discards the sample, reports an error and returns false. Variables created
+     * afterwards require another call. Also called by createProducer(). Not RT safe.
+     *
+     * @return True if all buffers have been allocated.
+     */
+    bool allocateBuffers();
 
-            Mat_VarWrite(mat_file, mat_var, MAT_COMPRESSION_ZLIB);
-            Mat_VarFree(mat_var);
+    /**
+     * @brief Memory used by each variable.
+     */
+    std::vector<VariableMemory> getMemoryReport() const;
 
-        }
+    /**
+     * @brief Size, compression ratio and write time of the variables written
+     * by the last flush() or, in streaming mode, by the last sealed segment.
+     * Returns a copy, since segments are sealed by a background thread.
+     * For MAT73 files, file_bytes_known is false and file_bytes is left at zero.
+     */
+    std::vector<VariableStats> getFlushStats() const;
 
-        Logger::success() << "Flushing to " << _file_name << " complete!" << Logger::endl();
+    /**
+     * @brief Sets the number of threads used by flush() to compress variables
+     * concurrently (MAT5 only).
+     *
+     * @param n_threads Number of threads, zero means one per available core (default)
+     * @return True if n_threads is valid.
+     */
+    bool setFlushThreads(int n_threads);
 
+    /**
+     * @brief Creates a Producer, i.e. an RT safe front-end to be used by a single
+     * thread, while other threads keep using the logger (e.g. to flush it).
+     * Samples are moved from the producer queue to the variables by a background
+     * thread, which applies the interleave. Not RT safe.
+     *
+     * Only variables which have been created before calling this method can be
+     * logged through the producer.
+     *
+     * @param queue_size Max number of samples waiting inside the queue
+     * @return A valid producer if the logger has not been flushed yet and
+     * at least one variable exists.
+     */
+    Producer createProducer(int queue_size = 4096);
 
+    /**
+     * @brief Total number of samples which have been discarded because of
+     * an overflow in streaming mode, or because a producer queue was full.
+     */
+    uint64_t getDroppedSamples() const;
 
-    }
+    /**
+     * @brief Does the actual work of saving data to disk. Since
+     * this is a time-consuming operation, should be done outside of
+     * any high performance loop. If not explicitly called in the code,
+     * flush() is anyway performed in the class destructor.
+     *
+     * In streaming mode, the background writer is stopped and the data that
+     * have been moved to disk are packed into the mat file (MAT5), or the
+     * mat file is simply finalized (MAT73).
+     */
+    void flush();
 
 
-    ~MatLogger(){
-    }
+    ~MatLogger();
 
 protected:
 
     MatLogger(std::string file_name):
-        _flushed(false)
+        _flushed(false),
+        _rearranging(false),
+        _dumping(false),
+        _file_format(FileFormat::MAT5),
+        _compression(Compression::Default),
+        _flush_threads(0),
+        _streaming(false),
+        _stream_mat(nullptr),
+        _stream_run(false),
+        _segment(0),
+        _segment_bytes(0),
+        _seal_run(false),
+        _time_mask(0),
+        _tick(&_tick_counter),
+        _tick_counter(0),
+        _consumer_run(false),
+        _arena_size(0),
+        _arena_used(0),
+        _arena_reserved(0),
+        _alloc_mode(AllocationMode::Default)
     {
         // retrieve time
         time_t rawtime;
@@ -562,17 +1647,879 @@ protected:
         file_name_extended = file_name+std::string(buffer);
 
         _file_name = file_name_extended;
+        _dump_dir = _file_name + ".rings";
+
+        register_signal_logger();
     }
 
-    std::unordered_map<std::string, VariableInfo> _var_idx_map;
-    std::unordered_map<std::string, Eigen::MatrixXd> _single_var_map;
-    std::string _file_name;
+    /**
+     * @brief Appends a new (empty) variable to the storage and registers
+     * its index in the name lookup table.
+     */
+    VariableInfo& create_variable(const std::string& name)
+    {
+        std::lock_guard<std::mutex> guard(_vars_mutex);
 
-private:
+        _var_idx_map[name] = _vars.size();
+        _vars.emplace_back();
+        _vars.back().name = name;
+
+        if( _streaming ){
+            _vars.back().stream.reset(new StreamState);
+        }
 
-    static std::unordered_map<std::string, Ptr> _instances;
+        return _vars.back();
+    }
+
+    int default_stream_buffer_size(int sample_bytes) const
+    {
+        return std::max(_stream_opts.buffer_bytes / sample_bytes, 2*_stream_opts.chunks_per_buffer);
+    }
+
+    /**
+     * @brief Allocates the (zero-initialized) circular buffer of a variable, whose
+     * elements are stored with the native type corresponding to Scalar.
+     */
+    template <typename Scalar>
+    bool init_storage(VariableInfo& varinfo)
+    {
+        typedef MatScalarTraits<Scalar> Traits;
+
+        varinfo.class_type = Traits::class_type;
+        varinfo.data_type = Traits::data_type;
+        varinfo.logical = Traits::logical;
+        varinfo.sample_bytes = varinfo.rows * varinfo.cols * sizeof(typename Traits::StorageType);
+        return allocate_storage(varinfo);
+    }
+
+    /**
+     * @brief Checks that a buffer of the requested size fits into the memory
+     * budget, or reserves the minimum size when its depth is decided by
+     * allocateBuffers() (buffer_size is then set to zero).
+     */
+    bool plan_buffer(const std::string& name, int sample_bytes, int default_size, int& buffer_size);
+
+    std::size_t buffer_bytes(int sample_bytes, int buffer_capacity) const;
+
+    int min_buffer_size() const;
+
+    std::shared_ptr<char> carve(std::size_t bytes);
+
+    bool allocate_buffers();
+
+    void report_unallocated(VariableInfo& varinfo);
+
+    /**
+     * @brief Allocates the (zero-initialized) circular buffer of a variable, either
+     * inside the arena or according to the allocation mode.
+     *
+     * @param ring With crash recovery, the ring file to be mapped instead of the one
+     * of the variable.
+     * @return False if the allocation failed.
+     */
+    bool allocate_storage(VariableInfo& varinfo, const std::string& ring = std::string());
+
+    std::shared_ptr<char> allocate_buffer(std::size_t bytes) const;
+
+    std::shared_ptr<char> create_ring_file(const std::string& file, std::size_t bytes) const;
+
+    static std::shared_ptr<char> open_ring_file(const std::string& file, const char * magic, std::vector<char>& desc, std::size_t& bytes);
+
+    std::vector<char> ring_description(const VariableInfo& varinfo) const;
+
+    static std::vector<char> ring_header(const char * magic, const std::vector<char>& desc);
+
+    static bool write_ring(const char * file, const std::vector<char>& header, uint64_t written, uint32_t tick,
+                           const char * data, std::size_t data_bytes, const char * ticks, std::size_t ticks_bytes);
+
+    std::string ring_file(int idx) const;
+
+    bool map_ring(VariableInfo& varinfo, const std::string& file);
+
+    bool map_time_ring(uint32_t capacity);
+
+    static bool load_ring(const std::string& file, VariableInfo& varinfo);
+
+    bool load_time_ring(const std::string& file);
+
+    void register_signal_logger();
+
+    void emergency_dump();
+
+    void write_raw_dump() const;
+
+    static void signal_handler(int sig);
+
+    static void signal_flusher();
+
+    /**
+     * @brief Removes the last created variable, whose buffer could not be allocated.
+     */
+    void discard_variable()
+    {
+        std::lock_guard<std::mutex> guard(_vars_mutex);
+
+        _var_idx_map.erase(_vars.back().name);
+
+        for( const FieldInfo& field : _vars.back().fields ){
+            _var_idx_map.erase(field.name);
+        }
+
+        _vars.pop_back();
+    }
+
+    template <typename... Fields>
+    struct FieldList {};
+
+    /**
+     * @brief Computes the layout of a record, appending the description of
+     * each field to the provided vector.
+     */
+    static void describe_fields(FieldList<>, const std::string *, int, std::vector<FieldInfo>&)
+    {
+    }
+
+    template <typename First, typename... Rest>
+    static void describe_fields(FieldList<First, Rest...>, const std::string * names, int offset, std::vector<FieldInfo>& fields)
+    {
+        typedef MatRecordField<First> Field;
+        typedef MatScalarTraits<typename Field::Scalar> Traits;
+
+        FieldInfo field;
+        field.name = names[0];
+        field.type = Field::Cols > 1 ? VariableType::Matrix : (Field::Rows > 1 ? VariableType::Vector : VariableType::Scalar);
+        field.class_type = Traits::class_type;
+        field.data_type = Traits::data_type;
+        field.logical = Traits::logical;
+        field.rows = Field::Rows;
+        field.cols = Field::Cols;
+        field.offset = offset;
+        field.bytes = Field::Rows * Field::Cols * sizeof(typename Traits::StorageType);
+
+        fields.push_back(field);
+
+        describe_fields(FieldList<Rest...>(), names + 1, offset + field.bytes, fields);
+    }
+
+    /**
+     * @brief Checks that the size of each value matches the one of its field.
+     */
+    static bool check_fields(FieldList<>)
+    {
+        return true;
+    }
+
+    template <typename First, typename... Rest, typename Value, typename... Values>
+    static bool check_fields(FieldList<First, Rest...>, const Value& value, const Values&... values)
+    {
+        return MatRecordField<First>::fits(value) && check_fields(FieldList<Rest...>(), values...);
+    }
+
+    /**
+     * @brief Writes the fields of a record sample one after the other; the
+     * layout is known at compile time, so that this compiles to a sequence
+     * of fixed-size stores.
+     */
+    static void store_fields(FieldList<>, char *)
+    {
+    }
+
+    template <typename First, typename... Rest, typename Value, typename... Values>
+    static void store_fields(FieldList<First, Rest...>, char * dst, const Value& value, const Values&... values)
+    {
+        typedef MatRecordField<First> Field;
+        typedef typename MatScalarTraits<typename Field::Scalar>::StorageType StorageType;
+
+        Field::template store<StorageType>(dst, value);
+
+        store_fields(FieldList<Rest...>(), dst + Field::Rows * Field::Cols * sizeof(StorageType), values...);
+    }
+
+    /**
+     * @brief Writes a sample to the provided location, converting it to
+     * the type used for storage.
+     */
+    template <typename Derived>
+    static void store_sample(char * dst, enum matio_classes class_type, bool logical, const Eigen::MatrixBase<Derived>& data)
+    {
+        switch( class_type ){
+
+            case MAT_C_SINGLE:
+                store_as<float>(dst, data);
+                break;
+
+            case MAT_C_INT32:
+                store_as<int32_t>(dst, data);
+                break;
+
+            case MAT_C_INT16:
+                store_as<int16_t>(dst, data);
+                break;
+
+            case MAT_C_UINT8:
+                if( logical ){
+                    store_as<bool>(dst, data);
+                }
+                else{
+                    store_as<uint8_t>(dst, data);
+                }
+                break;
+
+            default:
+                store_as<double>(dst, data);
+
+        }
+    }
+
+    template <typename StorageType, typename Derived>
+    static void store_as(char * dst, const Eigen::MatrixBase<Derived>& data)
+    {
+        // fixed-size data get a fixed-size map, so that the copy is unrolled (and vectorized)
+        typedef Eigen::Matrix<StorageType, Derived::RowsAtCompileTime, Derived::ColsAtCompileTime> SampleType;
+
+        Eigen::Map<SampleType> map((StorageType *)dst, data.rows(), data.cols());
+        map = data.template cast<StorageType>();
+    }
+
+    /**
+     * @brief Writes a sample to the circular buffer of the provided variable,
+     * taking care of the interleave.
+     */
+    template <typename Derived>
+    bool add_sample(VariableInfo& varinfo, const Eigen::MatrixBase<Derived>& data)
+    {
+        if( data.rows() != varinfo.rows || data.cols() != varinfo.cols ){
+            Logger::warning() << " in " << __func__ << "! Provided data for variable " << varinfo.name << " has unmatching dimensions!\n"
+             << "Rows: " << data.rows() << " != " << varinfo.rows << "\n"
+             << "Columns: " << data.cols() <<" != " << varinfo.cols<< Logger::endl();
+            return false;
+        }
+
+        WriteScope scope(varinfo);
+
+        if( !varinfo.aggregations.empty() ){
+            return aggregate(varinfo, data, _tick->load(std::memory_order_relaxed));
+        }
+
+        if( varinfo.compressed ){
+            return add_compressed(varinfo, data, _tick->load(std::memory_order_relaxed));
+        }
+
+        int slot = reserve_slot(varinfo);
+
+        if( slot < 0 ){
+            return slot == SKIP_SAMPLE;
+        }
+
+        store_sample(varinfo.data.get() + (size_t)slot * varinfo.sample_bytes, varinfo.class_type, varinfo.logical, data);
+
+        commit_slot(varinfo, slot);
+
+        return true;
+    }
+
+    /**
+     * @brief Accumulates a sample into the current window of a decimated
+     * variable and, at the end of the window, stores one aggregated sample
+     * for each statistic.
+     */
+    template <typename Derived>
+    bool aggregate(VariableInfo& varinfo, const Eigen::MatrixBase<Derived>& data, uint32_t tick)
+    {
+        auto sample = data.template cast<double>().array();
+
+        if( varinfo.window_count == 0 ){
+            varinfo.acc_sum = sample;
+            varinfo.acc_squares = sample.square();
+            varinfo.acc_min = sample;
+            varinfo.acc_max = sample;
+        }
+        else{
+            varinfo.acc_sum += sample;
+            varinfo.acc_squares += sample.square();
+            varinfo.acc_min = varinfo.acc_min.min(sample);
+            varinfo.acc_max = varinfo.acc_max.max(sample);
+        }
+
+        if( ++varinfo.window_count < varinfo.window ){
+            return true;
+        }
+
+        varinfo.window_count = 0;
+
+        int slot = reserve_slot(varinfo);
+
+        if( slot < 0 ){
+            return slot == SKIP_SAMPLE;
+        }
+
+        char * dst = varinfo.data.get() + (size_t)slot * varinfo.sample_bytes;
+        const double scale = 1.0 / varinfo.window;
+
+        for( unsigned int i = 0; i < varinfo.aggregations.size(); i++ ){
+
+            char * field_dst = dst + varinfo.fields[i].offset;
+
+            switch( varinfo.aggregations[i] ){
+
+                case Aggregation::Mean:
+                    store_sample(field_dst, varinfo.class_type, varinfo.logical, (varinfo.acc_sum * scale).matrix());
+                    break;
+
+                case Aggregation::Min:
+                    store_sample(field_dst, varinfo.class_type, varinfo.logical, varinfo.acc_min.matrix());
+                    break;
+
+                case Aggregation::Max:
+                    store_sample(field_dst, varinfo.class_type, varinfo.logical, varinfo.acc_max.matrix());
+                    break;
+
+                case Aggregation::Rms:
+                    store_sample(field_dst, varinfo.class_type, varinfo.logical, (varinfo.acc_squares * scale).sqrt().matrix());
+                    break;
+            }
+        }
+
+        commit_slot(varinfo, slot, tick);
+
+        return true;
+    }
+
+    void aggregate_stored(VariableInfo& varinfo, const char * data, uint32_t tick);
+
+    static void put_bits(uint8_t * block, uint32_t& pos, uint64_t value, int n_bits)
+    {
+        while( n_bits > 0 ){
+            int offset = pos & 7;
+            int n = std::min(8 - offset, n_bits);
+            block[pos >> 3] |= (uint8_t)((value & ((1u << n) - 1)) << offset);
+            value >>= n;
+            pos += n;
+            n_bits -= n;
+        }
+    }
+
+    static uint64_t get_bits(const uint8_t * block, uint32_t& pos, int n_bits)
+    {
+        uint64_t value = 0;
+        int shift = 0;
+
+        while( n_bits > 0 ){
+            int offset = pos & 7;
+            int n = std::min(8 - offset, n_bits);
+            value |= (uint64_t)((block[pos >> 3] >> offset) & ((1u << n) - 1)) << shift;
+            shift += n;
+            pos += n;
+            n_bits -= n;
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Upper bound of the bits taken by a sample inside a compressed block.
+     */
+    static uint32_t max_compressed_bits(int n_elements)
+    {
+        return 34 + n_elements * (2 + 5 + 6 + 64);
+    }
+
+    /**
+     * @brief Appends a sample to the compressed blocks of the provided variable,
+     * taking care of the interleave.
+     */
+    template <typename Derived>
+    bool add_compressed(VariableInfo& varinfo, const Eigen::MatrixBase<Derived>& data, uint32_t tick)
+    {
+        if( varinfo.interleave > 1 ){
+
+            varinfo.count = (varinfo.count + 1) % varinfo.interleave;
+
+            if( varinfo.count != 0 ){
+                return true;
+            }
+        }
+
+        CompressedRing& ring = *varinfo.compressed;
+        const int n_elements = varinfo.rows * varinfo.cols;
+        const bool has_ticks = (bool)_time_track;
+        bool first = false;
+
+        // open a new block, discarding the oldest one if needed
+        if( ring.used_blocks == 0 || ring.bit_pos + max_compressed_bits(n_elements) > 8u * ring.block_bytes ){
+
+            if( ring.used_blocks == ring.n_blocks ){
+                ring.first_block = (ring.first_block + 1) % ring.n_blocks;
+                ring.used_blocks--;
+            }
+
+            ring.used_blocks++;
+            ring.bit_pos = 32;
+            first = true;
+
+            memset(varinfo.data.get() + (size_t)((ring.first_block + ring.used_blocks - 1) % ring.n_blocks) * ring.block_bytes, 0, ring.block_bytes);
+        }
+
+        char * block_data = varinfo.data.get() + (size_t)((ring.first_block + ring.used_blocks - 1) % ring.n_blocks) * ring.block_bytes;
+        uint8_t * block = (uint8_t *)block_data;
+
+        // the first sample of a block is stored as it is, so that every block can be decoded alone
+        if( has_ticks ){
+            if( first ){
+                put_bits(block, ring.bit_pos, tick, 32);
+            }
+            else if( tick == ring.prev_tick + 1 ){
+                put_bits(block, ring.bit_pos, 0, 1);
+            }
+            else if( tick == ring.prev_tick ){
+                put_bits(block, ring.bit_pos, 1, 2);
+            }
+            else{
+                put_bits(block, ring.bit_pos, 3, 2);
+                put_bits(block, ring.bit_pos, tick, 32);
+            }
+            ring.prev_tick = tick;
+        }
+
+        for( int i = 0; i < n_elements; i++ ){
+
+            double value = data(i % varinfo.rows, i / varinfo.rows);
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+
+            if( first ){
+                put_bits(block, ring.bit_pos, bits, 64);
+                ring.prev[i] = bits;
+                ring.leading[i] = 0xFF;
+                continue;
+            }
+
+            uint64_t xor_bits = bits ^ ring.prev[i];
+            ring.prev[i] = bits;
+
+            if( xor_bits == 0 ){
+                put_bits(block, ring.bit_pos, 0, 1);
+                continue;
+            }
+
+            int leading = std::min(__builtin_clzll(xor_bits), 31);
+            int trailing = __builtin_ctzll(xor_bits);
+
+            // meaningful bits inside the window of the previous XOR
+            if( ring.leading[i] != 0xFF && leading >= ring.leading[i] && trailing >= ring.trailing[i] ){
+                put_bits(block, ring.bit_pos, 1, 2);
+                put_bits(block, ring.bit_pos, xor_bits >> ring.trailing[i], 64 - ring.leading[i] - ring.trailing[i]);
+                continue;
+            }
+
+            int n_bits = 64 - leading - trailing;
+            put_bits(block, ring.bit_pos, 3, 2);
+            put_bits(block, ring.bit_pos, leading, 5);
+            put_bits(block, ring.bit_pos, n_bits - 1, 6);
+            put_bits(block, ring.bit_pos, xor_bits >> trailing, n_bits);
+            ring.leading[i] = leading;
+            ring.trailing[i] = trailing;
+        }
+
+        uint32_t n_samples;
+        memcpy(&n_samples, block_data, sizeof(n_samples));
+        n_samples++;
+        memcpy(block_data, &n_samples, sizeof(n_samples));
+
+        varinfo.empty = false;
+
+        return true;
+    }
+
+    uint64_t decode_compressed(const VariableInfo& varinfo, std::unique_ptr<char[]>& data, std::unique_ptr<uint32_t[]>& ticks) const;
+
+    /**
+     * @brief Writes a group of samples (side by side in data) to the circular
+     * buffer of the provided variable, taking care of the interleave.
+     */
+    template <typename Derived>
+    bool add_batch(VariableInfo& varinfo, const Eigen::MatrixBase<Derived>& data)
+    {
+        if( data.rows() != varinfo.rows || data.cols() % varinfo.cols != 0 ){
+            Logger::warning() << " in " << __func__ << "! Provided data for variable " << varinfo.name << " has unmatching dimensions!\n"
+             << "Rows: " << data.rows() << " != " << varinfo.rows << "\n"
+             << "Columns: " << data.cols() << " are not a multiple of " << varinfo.cols << Logger::endl();
+            return false;
+        }
+
+        WriteScope scope(varinfo);
+
+        const int cols = varinfo.cols;
+        const int n_samples = data.cols() / cols;
+
+        // the circular buffer is shared with the writer thread, and windows are accumulated one sample at a time
+        if( _streaming || !varinfo.aggregations.empty() || varinfo.compressed ){
+
+            bool ok = true;
+
+            for( int i = 0; i < n_samples; i++ ){
+                ok = add_sample(varinfo, data.middleCols(i*cols, cols)) && ok;
+            }
+
+            return ok;
+        }
+
+        if( varinfo.buffer_capacity == 0 ){
+            report_unallocated(varinfo);
+            return false;
+        }
+
+        // sample i is logged if add() would have logged it, i.e. if (count + 1 + i) % interleave == 0
+        const int step = varinfo.interleave;
+        int first = 0;
+
+        if( step > 1 ){
+            first = (step - (varinfo.count + 1) % step) % step;
+            varinfo.count = (varinfo.count + n_samples) % step;
+        }
+
+        if( first >= n_samples ){
+            return true;
+        }
+
+        const int capacity = varinfo.buffer_capacity;
+        const int n_logged = (n_samples - 1 - first) / step + 1;
+
+        // older samples would be overwritten by the newer ones in the same batch
+        const int n_copied = std::min(n_logged, capacity);
+        const int n_skipped = n_logged - n_copied;
+        first += n_skipped * step;
+
+        int size = varinfo.empty ? 0 : (varinfo.tail > varinfo.head ? varinfo.tail - varinfo.head : capacity);
+        int start = (varinfo.tail + n_skipped % capacity) % capacity;
+        uint32_t tick = _tick->load(std::memory_order_relaxed);
+
+        // at most two contiguous segments, split at the end of the buffer
+        int copied = 0;
+
+        while( copied < n_copied ){
+
+            int slot = (start + copied) % capacity;
+            int count = std::min(n_copied - copied, capacity - slot);
+            char * dst = varinfo.data.get() + (size_t)slot * varinfo.sample_bytes;
+
+            if( step == 1 ){
+                store_sample(dst, varinfo.class_type, varinfo.logical, data.middleCols((first + copied) * cols, count * cols));
+            }
+            else{
+                for( int i = 0; i < count; i++ ){
+                    store_sample(dst + (size_t)i * varinfo.sample_bytes, varinfo.class_type, varinfo.logical,
+                                 data.middleCols((first + (copied + i) * step) * cols, cols));
+                }
+            }
+
+            if( varinfo.ticks ){
+                std::fill(varinfo.ticks.get() + slot, varinfo.ticks.get() + slot + count, tick);
+            }
+
+            copied += count;
+        }
+
+        // same state as after n_logged calls to commit_slot()
+        int end = start + n_copied;
+        varinfo.tail = end > capacity ? end - capacity : end;
+
+        if( (int64_t)size + n_logged >= capacity ){
+            varinfo.head = varinfo.tail % capacity;
+        }
+
+        varinfo.empty = false;
+
+        if( varinfo.ring_written ){
+            varinfo.ring_written->store(varinfo.ring_written->load(std::memory_order_relaxed) + n_logged, std::memory_order_release);
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Marks a variable as being written while in scope, so that the
+     * emergency flush can skip the variables whose writer has been interrupted
+     * by the signal (see installSignalHandlers()). Scopes can be nested.
+     */
+    struct WriteScope {
+
+        WriteScope(VariableInfo& varinfo):
+            writing(varinfo.writing),
+            nested(varinfo.writing.load(std::memory_order_relaxed))
+        {
+            writing.store(true, std::memory_order_relaxed);
+
+            // the handler runs on the same thread: only the compiler must not reorder
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+
+        ~WriteScope()
+        {
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            writing.store(nested, std::memory_order_relaxed);
+        }
+
+        std::atomic<bool>& writing;
+        bool nested;
+
+    };
+
+    static const int SKIP_SAMPLE = -1;  // not logged because of the interleave
+    static const int DROP_SAMPLE = -2;  // discarded because of an overflow in streaming mode
+
+    /**
+     * @brief Applies the interleave and returns the position of the circular
+     * buffer where the next sample must be written, or a negative value
+     * (SKIP_SAMPLE, DROP_SAMPLE) if it must not be written. Once the sample has
+     * been written, it must be published by calling commit_slot().
+     *
+     * In streaming mode, the circular buffer is shared with the writer thread,
+     * and it is never overwritten: the OverflowPolicy is applied instead.
+     */
+    int reserve_slot(VariableInfo& varinfo)
+    {
+        if( varinfo.buffer_capacity == 0 ){
+            report_unallocated(varinfo);
+            return DROP_SAMPLE;
+        }
+
+        if( varinfo.interleave > 1 ){
+
+            varinfo.count = (varinfo.count + 1) % varinfo.interleave;
+
+            if( varinfo.count != 0 ){
+                return SKIP_SAMPLE;
+            }
+        }
+
+        if( _streaming ){
+
+            StreamState& stream = *varinfo.stream;
+
+            uint64_t written = stream.written.load(std::memory_order_relaxed);
+
+            while( written - stream.drained.load(std::memory_order_acquire) >= (uint64_t)varinfo.buffer_capacity ){
+
+                if( _stream_opts.overflow_policy == OverflowPolicy::DropNewest || !_stream_run ){
+                    stream.dropped.fetch_add(1, std::memory_order_relaxed);
+                    return DROP_SAMPLE;
+                }
+
+                std::this_thread::yield();
+            }
+
+            return written % varinfo.buffer_capacity;
+        }
+
+        // tail never exceeds the capacity, no need for a modulo
+        if( varinfo.tail == varinfo.buffer_capacity ){
+            varinfo.tail = 0;
+        }
+
+        // if buffer is not empty and head = tail, increment head since we are going to overwrite an element
+        if( !varinfo.empty && varinfo.head == varinfo.tail ){
+            varinfo.head = varinfo.head + 1 == varinfo.buffer_capacity ? 0 : varinfo.head + 1;
+        }
+
+        return varinfo.tail;
+    }
+
+    void commit_slot(VariableInfo& varinfo, int slot)
+    {
+        commit_slot(varinfo, slot, _tick->load(std::memory_order_relaxed));
+    }
+
+    void commit_slot(VariableInfo& varinfo, int slot, uint32_t tick)
+    {
+        if( varinfo.ticks ){
+            varinfo.ticks.get()[slot] = tick;
+        }
+
+        if( _streaming ){
+            StreamState& stream = *varinfo.stream;
+            stream.written.store(stream.written.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            return;
+        }
+
+        varinfo.empty = false;
+
+        // increment tail position
+        varinfo.tail = (varinfo.tail + 1);
+
+        if( varinfo.ring_written ){
+            varinfo.ring_written->store(varinfo.ring_written->load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    }
+
+    void consumer_loop();
+
+    bool consume();
+
+    void stop_consumer();
+
+    void stream_loop();
+
+    void drain(VariableInfo& varinfo, bool drain_all);
+
+    bool append(VariableInfo& varinfo, const char * data, uint64_t n_samples);
+
+    void stop_stream();
+
+    void close_spool(VariableInfo& varinfo);
+
+    bool segment_due() const;
+
+    /**
+     * @brief A rotated segment, whose spool files are sealed into its mat file
+     * by the sealing thread (see rotate()).
+     */
+    struct Segment {
+        std::string file;
+        mat_t * mat = nullptr;              // MAT v7.3 only: the file the samples have been appended to
+        std::deque<VariableInfo> vars;      // copies of the variables, pointing to the spool files of the segment
+    };
+
+    bool rotate();
+
+    void seal_loop();
+
+    bool seal(Segment& segment);
+
+    void stop_sealing();
+
+    std::string segment_file() const;
+
+    bool append_time(VariableInfo& varinfo, const double * times, uint64_t n_samples);
+
+    bool spool(int& fd, const std::string& file, const char * data, std::size_t bytes, std::size_t spooled_bytes);
+
+    static void * map_file(const std::string& file, std::size_t bytes);
+
+    double tick_time(uint32_t tick) const;
+
+    void get_times(const VariableInfo& varinfo, uint64_t first_slot, uint64_t n_samples, double * times) const;
+
+    /**
+     * @brief Description of a variable as it is written to the mat file.
+     */
+    struct MatVariable {
+        std::string name;
+        enum matio_classes class_type;
+        enum matio_types data_type;
+        bool logical;
+        int rank;
+        std::size_t dims[3];
+        const void * data;
+        std::size_t bytes;
+        Compression compression;
+    };
+
+    static int get_dims(VariableType type, int rows, int cols, uint64_t n_samples, std::size_t * dims);
+
+    MatVariable describe(const VariableInfo& varinfo, uint64_t n_samples, const void * data) const;
+
+    void describe_record(const VariableInfo& varinfo,
+                         uint64_t n_samples,
+                         const char * data,
+                         std::vector<MatVariable>& vars,
+                         std::vector<std::unique_ptr<char[]>>& buffers) const;
+
+    void describe_time(const VariableInfo& varinfo,
+                       uint64_t n_samples,
+                       const double * times,
+                       std::vector<MatVariable>& vars) const;
+
+    bool describe_spool(const VariableInfo& varinfo,
+                        std::vector<MatVariable>& vars,
+                        std::vector<std::unique_ptr<char[]>>& buffers,
+                        std::vector<std::pair<void *, std::size_t>>& mappings) const;
+
+    static matvar_t * create_mat_var(const MatVariable& var);
+
+    static enum matio_compression to_matio_compression(Compression compression);
+
+    static bool mat5_header(const MatVariable& var, std::vector<char>& header);
+
+    static bool compress_mat5(const MatVariable& var,
+                              const std::vector<char>& header,
+                              std::unique_ptr<char[]>& element,
+                              std::size_t& element_bytes);
+
+    bool write_mat5(const std::vector<MatVariable>& vars, const std::string& file_name);
+
+    bool write_mat73(mat_t * mat_file, const std::vector<MatVariable>& vars);
+
+    void publish_flush_stats(std::vector<VariableStats>& flush_stats);
+
+    bool dump();
+
+    std::deque<VariableInfo> _vars;        // a deque never moves its elements, so that handles can point to them
+    std::unordered_map<std::string, int> _var_idx_map;
+    std::unordered_map<std::string, Eigen::MatrixXd> _single_var_map;
+    std::string _file_name;
+
+private:
+
+    typedef std::unordered_map<std::string, Ptr> Registry;
+
+    // current snapshot of the registry, replaced (never modified) when a logger is created
+    static std::atomic<const Registry *> _registry;
+
+    static Ptr register_logger(const std::string& filename);
+
+    static std::mutex& instances_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
 //     ConsoleLogger::Ptr _clog;
-    bool _flushed;
+    std::atomic<bool> _flushed;
+    std::atomic<bool> _rearranging;     // flush() has started rotating the buffers in place
+    std::atomic<bool> _dumping;         // the signal handler is reading the buffers
+    FileFormat _file_format;
+    Compression _compression;
+    int _flush_threads;
+    std::vector<VariableStats> _flush_stats;
+    mutable std::mutex _flush_stats_mutex;
+
+    bool _streaming;
+    StreamingOptions _stream_opts;
+    std::string _stream_dir;
+    mat_t * _stream_mat;
+    std::atomic<bool> _stream_run;
+    std::thread _stream_thread;
+    std::mutex _vars_mutex;
+
+    int _segment;                       // index of the current segment, 0 if the file is not rotated
+    std::size_t _segment_bytes;
+    std::chrono::steady_clock::time_point _segment_start;
+
+    std::thread _seal_thread;           // MAT v5 only: seals the rotated segments
+    std::mutex _seal_mutex;
+    std::condition_variable _seal_cond;
+    std::deque<std::unique_ptr<Segment>> _seal_queue;
+    bool _seal_run;
+
+    std::shared_ptr<std::atomic<uint64_t>> _time_track;
+    uint32_t _time_mask;
+    std::atomic<uint32_t> * _tick;      // points to _tick_counter, or inside the time ring file
+    std::atomic<uint32_t> _tick_counter;
+
+    std::vector<std::unique_ptr<ProducerQueue>> _producers;
+    std::atomic<bool> _consumer_run;
+    std::thread _consumer_thread;
+
+    std::shared_ptr<char> _arena;
+    std::size_t _arena_size;
+    std::size_t _arena_used;
+    std::size_t _arena_reserved;        // minimum size of the buffers waiting for allocateBuffers()
+
+    AllocationMode _alloc_mode;
+
+    std::string _ring_dir;
+    std::string _dump_dir;              // ring directory used by the emergency dump
+    std::vector<char> _time_header;
 
 };
 
@@ -22,13 +22,52 @@
 
 
 #include <iostream>
+#include <memory>
+#include <cstdint>
 #include <stdarg.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/device/array.hpp>
 
 
+/**
+ * Minimum severity of the messages which are compiled (as an integer, see Logger::Severity)
+ * when logging through the XBOT_INFO()... macros. Call sites with a lower severity are removed
+ * entirely, arguments included: e.g. -DXBOT_LOGGER_MIN_SEVERITY=1 removes DEBUG and LOW messages.
+ */
+#ifndef XBOT_LOGGER_MIN_SEVERITY
+#define XBOT_LOGGER_MIN_SEVERITY -1
+#endif
+
+/**
+ * Skips the statement which follows, without evaluating it, if messages of severity s
+ * are either compiled out or below the verbosity level.
+ */
+#define XBOT_LOG_IF_ENABLED(s) if( !XBot::Logger::IsEnabled(s) ){} else
+
+/**
+ * Logging macros, e.g. XBOT_INFO(Logger::Severity::LOW) << "x = " << x << Logger::endl();
+ * or XBOT_INFO_F(Logger::Severity::LOW, "x = %f", x);
+ */
+#define XBOT_INFO(s)            XBOT_LOG_IF_ENABLED(s) XBot::Logger::info(s)
+#define XBOT_WARNING(s)         XBOT_LOG_IF_ENABLED(s) XBot::Logger::warning(s)
+#define XBOT_ERROR(s)           XBOT_LOG_IF_ENABLED(s) XBot::Logger::error(s)
+#define XBOT_SUCCESS(s)         XBOT_LOG_IF_ENABLED(s) XBot::Logger::success(s)
+
+#define XBOT_INFO_F(s, ...)     XBOT_LOG_IF_ENABLED(s) XBot::Logger::info(s, __VA_ARGS__)
+#define XBOT_WARNING_F(s, ...)  XBOT_LOG_IF_ENABLED(s) XBot::Logger::warning(s, __VA_ARGS__)
+#define XBOT_ERROR_F(s, ...)    XBOT_LOG_IF_ENABLED(s) XBot::Logger::error(s, __VA_ARGS__)
+#define XBOT_SUCCESS_F(s, ...)  XBOT_LOG_IF_ENABLED(s) XBot::Logger::success(s, __VA_ARGS__)
+
+
 namespace XBot { 
     
     /* Modifiers */
@@ -51,10 +90,10 @@ namespace XBot {
     class LoggerClass;
     
     /**
-     * @brief Forward declaration for Mutex
+     * @brief Forward declaration for the asynchronous console output
      * 
      */
-    class Mutex;
+    class AsyncSink;
     
     
     
@@ -88,6 +127,14 @@ namespace XBot {
         
         enum class Severity { DEBUG = -1, LOW = 0, MID = 1, HIGH = 2, FATAL = 3 };
         
+        /**
+         * @brief What happens to a message when the queue of the asynchronous output is full.
+         */
+        enum class OverflowPolicy {
+            Drop,   // the message is discarded and counted (see GetDroppedMessages())
+            Block   // the caller waits for the writer thread (NOT RT safe)
+        };
+        
         /**
          * @brief Writes to the internal stream with no special formatting and without changing
          * the severity level (which defaults to HIGH). 
@@ -209,6 +256,69 @@ namespace XBot {
          * in order to actually be printed.
          */
         static Logger::Severity GetVerbosityLevel();
+        
+        /**
+         * @brief Returns true if messages of severity s are compiled in (see XBOT_LOGGER_MIN_SEVERITY)
+         * and not below the verbosity level.
+         */
+        static bool IsEnabled(Logger::Severity s);
+        
+        /**
+         * @brief Sets how the console output is flushed (by default, every message is written
+         * at once). Messages with severity at least flush_severity are written at once together
+         * with the pending ones; the others are gathered, per thread, and written by a single
+         * write() when batch_bytes are pending, when max_delay_ms have elapsed since the first
+         * pending one, or by Flush(). The delay is checked at the next message of the thread and
+         * by a background thread, started by the first policy which gathers messages, that wakes
+         * up every max_delay_ms/2: the messages of a quiet thread are therefore written within
+         * about 1.5*max_delay_ms, and a thread which logs while its batch is being written waits
+         * for that write.
+         * Not used by the asynchronous output, which always writes in batches.
+         * 
+         * @param flush_severity Minimum severity of the messages which are written at once
+         * @param batch_bytes Maximum size of the pending messages of a thread
+         * @param max_delay_ms Maximum delay of a pending message
+         */
+        static void SetFlushPolicy(Logger::Severity flush_severity, int batch_bytes = 64*1024, int max_delay_ms = 100);
+        
+        /**
+         * @brief Writes the pending messages of the calling thread (see SetFlushPolicy()).
+         */
+        static void Flush();
+        
+        /**
+         * @brief Enables the asynchronous console output: printed messages are copied
+         * into a preallocated lock-free queue, and written to stdout by a background
+         * thread with a few large writev() calls, so that logging never blocks on the
+         * terminal.
+         * 
+         * With deferred formatting, the printf-like methods do not format the message:
+         * the format string pointer and the arguments are queued as raw bytes, and the
+         * message is rendered by the background thread. Format strings must then outlive
+         * the message (e.g. string literals); strings passed by %s are copied.
+         * 
+         * @param queue_size Number of records of the queue (records have a fixed size,
+         * long messages take several of them)
+         * @param policy Behavior when the queue is full
+         * @param deferred_formatting Whether printf-like messages are formatted by the background thread
+         * @return True if the asynchronous output has been enabled.
+         */
+        static bool EnableAsync(int queue_size = 1024,
+                                Logger::OverflowPolicy policy = Logger::OverflowPolicy::Drop,
+                                bool deferred_formatting = false);
+        
+        /**
+         * @brief Writes all pending messages and goes back to the synchronous output.
+         * Threads which are logging meanwhile are waited for, so that this call may
+         * be made at any time.
+         */
+        static void DisableAsync();
+        
+        /**
+         * @brief Returns the number of messages discarded because the queue of the
+         * asynchronous output was full.
+         */
+        static uint64_t GetDroppedMessages();
 
         
     protected:
@@ -223,7 +333,9 @@ namespace XBot {
     
     
     /**
-     * @brief Logger class.
+     * @brief Logger class. Every thread composes its messages inside its own
+     * buffer, which is printed as a whole by endl(): logging is therefore
+     * thread-safe without any lock.
      * 
      */
     class LoggerClass {
@@ -360,42 +472,149 @@ namespace XBot {
          */
         Logger::Severity getVerbosityLevel() const;
         
+        /**
+         * @brief Sets how the console output is flushed (see Logger::SetFlushPolicy()).
+         */
+        void setFlushPolicy(Logger::Severity flush_severity, int batch_bytes = 64*1024, int max_delay_ms = 100);
+        
+        /**
+         * @brief Writes the pending messages of the calling thread.
+         */
+        void flush();
+        
+        /**
+         * @brief Returns true if messages of severity s are not below the verbosity level.
+         * Messages which are below it are discarded as soon as they are started.
+         */
+        bool isEnabled(Logger::Severity s) const
+        {
+            return (int)s >= (int)_verbosity_level.load(std::memory_order_relaxed);
+        }
+        
+        /**
+         * @brief Enables the asynchronous console output (see Logger::EnableAsync()).
+         */
+        bool enableAsync(int queue_size = 1024,
+                         Logger::OverflowPolicy policy = Logger::OverflowPolicy::Drop,
+                         bool deferred_formatting = false);
+        
+        /**
+         * @brief Writes all pending messages and goes back to the synchronous output
+         * (see Logger::DisableAsync()).
+         */
+        void disableAsync();
+        
+        /**
+         * @brief Returns the number of messages discarded by the asynchronous output.
+         */
+        uint64_t getDroppedMessages() const;
+        
         
         
     private:
         
         typedef boost::iostreams::stream<boost::iostreams::array_sink> ostream_t;
         
+        static const int BUFFER_SIZE = 4096;
+        
+        /**
+         * @brief Message under construction, one for each thread.
+         */
+        struct Message {
+            
+            Message(LoggerClass * logger);
+            
+            ~Message();
+            
+            void flush_batch();
+            
+            bool batch_expired(std::chrono::steady_clock::time_point now) const;
+            
+            LoggerClass * logger;
+            
+            char buffer[BUFFER_SIZE + 1];   // one spare byte for the newline
+            
+            ostream_t sink;
+            
+            Logger::Severity severity;
+            
+            std::ostream null_sink;     // returned for suppressed messages, discards everything
+            
+            bool suppressed;
+            
+            std::vector<char> batch;    // messages waiting to be written
+            
+            std::chrono::steady_clock::time_point batch_start;
+            
+            std::mutex batch_mutex;     // guards the batch, which is also written by the flusher thread
+            
+            std::atomic<bool> pending;  // the batch is not empty, only set by the owning thread
+            
+        };
+        
+        Message& message();
+        
+        static void delete_message(void * message);
+        
+        void flush_pending(bool expired_only);
+        
+        void start_flusher();
+        
+        void stop_flusher();
+        
+        void flusher_loop();
+        
         void print();
         
-        void print_internal();
+        void print_internal(Message& msg, std::size_t length);
         
-        void init_sink();
+        void init_sink(Message& msg);
+        
+        std::ostream& begin(Logger::Severity s, const std::string& header);
         
         void __info(Logger::Severity s, const char * fmt, va_list args);
         void __error(Logger::Severity s, const char * fmt, va_list args);
         void __warning(Logger::Severity s, const char * fmt, va_list args);
         void __success(Logger::Severity s, const char * fmt, va_list args);
         void __fmt_print(const char * fmt, va_list args);
+        bool defer(const std::string& header, const char * fmt, va_list args);
         
-        static const int BUFFER_SIZE = 4096;
+        AsyncSink * acquire_async() const;
+        void release_async() const;
         
-        char _buffer[BUFFER_SIZE];
-        
-        ostream_t _sink;
+        pthread_key_t _message_key;
         
         Endl _endl;
         
         std::string _name, _name_tag;
-        Logger::Severity _severity;
-        Logger::Severity _verbosity_level;
+        std::string _info_header, _error_header, _warning_header, _success_header;
+        std::atomic<Logger::Severity> _verbosity_level;
+        
+        std::atomic<Logger::Severity> _flush_severity;
+        std::atomic<int> _batch_bytes;
+        std::atomic<int> _max_delay_ms;
+        
+        // messages of all threads, so that the pending batches of quiet threads can be written
+        std::mutex _messages_mutex;
+        std::vector<Message *> _messages;
         
+        std::thread _flusher;
+        std::mutex _flusher_mutex;
+        std::condition_variable _flusher_cond;
+        bool _flusher_run;
         
-        std::unique_ptr<Mutex> _mutex;
+        // published atomically; disableAsync() waits for the users of the sink before deleting it
+        std::atomic<AsyncSink *> _async;
+        mutable std::atomic<int> _async_users;
+        std::atomic<uint64_t> _async_dropped;
         
     };
 
     
+    inline bool Logger::IsEnabled(Logger::Severity s)
+    {
+        return (int)s >= XBOT_LOGGER_MIN_SEVERITY && _logger.isEnabled(s);
+    }
     
 
 
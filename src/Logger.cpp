@@ -22,7 +22,7 @@
 namespace XBot {
 
 
-std::unordered_map<std::string, MatLogger::Ptr> MatLogger::_instances;
+std::atomic<const MatLogger::Registry *> MatLogger::_registry(nullptr);
 
 
 }
\ No newline at end of file
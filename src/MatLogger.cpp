@@ -0,0 +1,3237 @@
+/*
+ * Copyright (C) 2017 IIT-ADVR
+ * Author: Arturo Laurenzi, Luca Muratore
+ * email:  arturo.laurenzi@iit.it, luca.muratore@iit.it
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <XBotLogger/Logger.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+namespace {
+
+    const char mat5_zeros[8] = {0};
+
+    std::size_t mat5_padding(std::size_t bytes)
+    {
+        return (8 - bytes % 8) % 8;
+    }
+
+    bool write_all(int fd, const char * data, size_t bytes)
+    {
+        while( bytes > 0 ){
+
+            ssize_t ret = ::write(fd, data, bytes);
+
+            if( ret < 0 ){
+                if( errno == EINTR ) continue;
+                return false;
+            }
+
+            data += ret;
+            bytes -= ret;
+        }
+
+        return true;
+    }
+
+    /* Writes a MAT v5 element whose data are provided piecewise (see MatLogger::merge()),
+     * deflating it on the fly unless level is Z_NO_COMPRESSION. The size of a compressed
+     * element is only known at the end, when it is written back into its tag. */
+    class Mat5Stream {
+
+    public:
+
+        explicit Mat5Stream(int fd): _fd(fd), _start(-1), _deflating(false)
+        {
+            memset(&_zs, 0, sizeof(_zs));
+        }
+
+        ~Mat5Stream()
+        {
+            if( _deflating ){
+                deflateEnd(&_zs);
+            }
+        }
+
+        bool begin(const std::vector<char>& header, int level)
+        {
+            _start = lseek(_fd, 0, SEEK_END);
+
+            if( _start < 0 ){
+                return false;
+            }
+
+            if( level == Z_NO_COMPRESSION ){
+                return write_all(_fd, header.data(), header.size());
+            }
+
+            if( deflateInit(&_zs, level) != Z_OK ){
+                return false;
+            }
+
+            _deflating = true;
+            _out.resize(1 << 16);
+
+            // miCOMPRESSED tag, whose size is filled by end()
+            uint32_t tag[2] = { MAT_T_COMPRESSED, 0 };
+
+            return write_all(_fd, (const char *)tag, sizeof(tag)) && write(header.data(), header.size());
+        }
+
+        bool write(const char * data, std::size_t bytes)
+        {
+            return _deflating ? deflate_data(data, bytes, Z_NO_FLUSH) : write_all(_fd, data, bytes);
+        }
+
+        bool end(std::size_t padding)
+        {
+            if( !_deflating ){
+                return write_all(_fd, mat5_zeros, padding);
+            }
+
+            bool ok = deflate_data(mat5_zeros, padding, Z_FINISH) && _zs.total_out <= 0xFFFFFFFFu;
+
+            uint32_t tag[2] = { MAT_T_COMPRESSED, (uint32_t)_zs.total_out };
+
+            ok = ok && pwrite(_fd, tag, sizeof(tag), _start) == (ssize_t)sizeof(tag);
+
+            deflateEnd(&_zs);
+            _deflating = false;
+
+            if( !ok ){
+                abort();
+            }
+
+            return ok;
+        }
+
+        // drops whatever has been written of the element
+        bool abort()
+        {
+            if( _deflating ){
+                deflateEnd(&_zs);
+                _deflating = false;
+            }
+
+            return _start < 0 || ftruncate(_fd, _start) == 0;
+        }
+
+    private:
+
+        bool deflate_data(const char * data, std::size_t bytes, int flush)
+        {
+            _zs.next_in = (Bytef *)data;
+            _zs.avail_in = bytes;
+
+            do {
+                _zs.next_out = (Bytef *)_out.data();
+                _zs.avail_out = _out.size();
+
+                if( deflate(&_zs, flush) == Z_STREAM_ERROR ||
+                    !write_all(_fd, _out.data(), _out.size() - _zs.avail_out) ){
+                    return false;
+                }
+
+            } while( _zs.avail_out == 0 );
+
+            return true;
+        }
+
+        int _fd;
+        off_t _start;
+        bool _deflating;
+        z_stream _zs;
+        std::vector<char> _out;
+
+    };
+
+    // type of the data of a numeric class, as written by MatLogger
+    enum matio_types class_data_type(enum matio_classes class_type)
+    {
+        switch( class_type ){
+            case MAT_C_DOUBLE: return MAT_T_DOUBLE;
+            case MAT_C_SINGLE: return MAT_T_SINGLE;
+            case MAT_C_INT8:   return MAT_T_INT8;
+            case MAT_C_UINT8:  return MAT_T_UINT8;
+            case MAT_C_INT16:  return MAT_T_INT16;
+            case MAT_C_UINT16: return MAT_T_UINT16;
+            case MAT_C_INT32:  return MAT_T_INT32;
+            case MAT_C_UINT32: return MAT_T_UINT32;
+            case MAT_C_INT64:  return MAT_T_INT64;
+            case MAT_C_UINT64: return MAT_T_UINT64;
+            default:           return MAT_T_UNKNOWN;
+        }
+    }
+
+    const char ring_magic[8] = {'X', 'B', 'O', 'T', 'R', 'I', 'N', 'G'};
+    const char time_magic[8] = {'X', 'B', 'O', 'T', 'T', 'I', 'M', 'E'};
+    const uint32_t ring_version = 1;
+
+    uint32_t crc32c(const char * data, std::size_t bytes, uint32_t crc = 0)
+    {
+        static const std::vector<uint32_t> table = [](){
+
+            std::vector<uint32_t> table(256);
+
+            for( uint32_t i = 0; i < 256; i++ ){
+
+                uint32_t c = i;
+
+                for( int k = 0; k < 8; k++ ){
+                    c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+                }
+
+                table[i] = c;
+            }
+
+            return table;
+        }();
+
+        crc = ~crc;
+
+        for( std::size_t i = 0; i < bytes; i++ ){
+            crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+        }
+
+        return ~crc;
+    }
+
+    void put_int(std::vector<char>& desc, int64_t value)
+    {
+        const char * bytes = (const char *)&value;
+        desc.insert(desc.end(), bytes, bytes + sizeof(value));
+    }
+
+    void put_string(std::vector<char>& desc, const std::string& value)
+    {
+        put_int(desc, value.size());
+        desc.insert(desc.end(), value.begin(), value.end());
+    }
+
+    bool get_int(const char *& ptr, const char * end, int64_t& value)
+    {
+        if( end - ptr < (std::ptrdiff_t)sizeof(value) ){
+            return false;
+        }
+
+        memcpy(&value, ptr, sizeof(value));
+        ptr += sizeof(value);
+
+        return true;
+    }
+
+    template <typename Int>
+    bool get_int(const char *& ptr, const char * end, Int& value)
+    {
+        int64_t value64;
+
+        if( !get_int(ptr, end, value64) || value64 < INT_MIN || value64 > INT_MAX ){
+            return false;
+        }
+
+        value = (Int)value64;
+
+        return true;
+    }
+
+    const int max_signal_loggers = 64;
+    std::atomic<XBot::MatLogger *> signal_loggers[max_signal_loggers];
+
+    const int handled_signals[] = {SIGINT, SIGTERM, SIGSEGV};
+    const int n_handled_signals = sizeof(handled_signals) / sizeof(handled_signals[0]);
+    struct sigaction previous_actions[n_handled_signals];
+
+    sem_t flush_request;
+    std::atomic<bool> flush_done(false);    // polled by the handler, sem_timedwait() is not async-signal-safe
+    int flush_timeout_ms = 0;
+    std::atomic<bool> signal_handlers_installed(false);
+    std::atomic<bool> handling_signal(false);
+
+    // internal threads leave asynchronous signals to the application threads
+    void block_signals()
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+
+    // async-signal-safe version of dir + "/" + name + suffix, where name is
+    // an index if not null
+    bool make_path(char * path, std::size_t size, const std::string& dir, int idx, const char * name, const char * suffix)
+    {
+        char digits[16];
+        int n_digits = 0;
+
+        if( !name ){
+            do {
+                digits[n_digits++] = '0' + idx % 10;
+                idx /= 10;
+            } while( idx > 0 );
+        }
+
+        std::size_t name_len = name ? strlen(name) : n_digits;
+        std::size_t suffix_len = strlen(suffix);
+
+        if( dir.size() + 1 + name_len + suffix_len + 1 > size ){
+            return false;
+        }
+
+        char * ptr = path;
+        memcpy(ptr, dir.data(), dir.size());
+        ptr += dir.size();
+        *ptr++ = '/';
+
+        if( name ){
+            memcpy(ptr, name, name_len);
+            ptr += name_len;
+        }
+
+        while( n_digits > 0 ){
+            *ptr++ = digits[--n_digits];
+        }
+
+        memcpy(ptr, suffix, suffix_len + 1);
+
+        return true;
+    }
+
+    bool get_string(const char *& ptr, const char * end, std::string& value)
+    {
+        int64_t size;
+
+        if( !get_int(ptr, end, size) || size < 0 || end - ptr < size ){
+            return false;
+        }
+
+        value.assign(ptr, size);
+        ptr += size;
+
+        return true;
+    }
+
+}
+
+namespace XBot {
+
+
+MatLogger::Ptr MatLogger::register_logger(const std::string& filename)
+{
+    // every snapshot ever published is kept alive, since wait-free readers may still use it;
+    // loggers are few and are never removed, so this only costs a handful of small maps
+    struct Snapshots {
+        std::vector<std::unique_ptr<const Registry>> list;
+        ~Snapshots(){
+            _registry.store(nullptr, std::memory_order_release);
+            list.clear();
+        }
+    };
+
+    static Snapshots snapshots;
+
+    std::lock_guard<std::mutex> guard(instances_mutex());
+
+    const Registry * current = _registry.load(std::memory_order_acquire);
+
+    if( current ){
+
+        auto it = current->find(filename);
+
+        // created by another thread in the meantime
+        if( it != current->end() ){
+            return it->second;
+        }
+    }
+
+    std::unique_ptr<Registry> registry(current ? new Registry(*current) : new Registry);
+    Ptr logger(new MatLogger(filename));
+    (*registry)[filename] = logger;
+
+    snapshots.list.emplace_back(registry.release());
+    _registry.store(snapshots.list.back().get(), std::memory_order_release);
+
+    return logger;
+}
+
+bool MatLogger::startStreaming()
+{
+    return startStreaming(StreamingOptions());
+}
+
+bool MatLogger::startStreaming(const StreamingOptions& options)
+{
+    if( _streaming ){
+        Logger::error() << "Streaming mode already enabled for " << _file_name << Logger::endl();
+        return false;
+    }
+
+    if( !_vars.empty() || _flushed ){
+        Logger::error() << "Streaming mode must be enabled before creating any variable" << Logger::endl();
+        return false;
+    }
+
+    if( !_ring_dir.empty() ){
+        Logger::error() << "Streaming mode is not available with crash recovery" << Logger::endl();
+        return false;
+    }
+
+    if( options.buffer_bytes <= 0 || options.chunks_per_buffer <= 0 || options.period_ms <= 0 ||
+        options.segment_seconds < 0 ){
+        Logger::error() << "Invalid streaming options" << Logger::endl();
+        return false;
+    }
+
+    _segment = options.segment_bytes > 0 || options.segment_seconds > 0 ? 1 : 0;
+    _segment_bytes = 0;
+    _segment_start = std::chrono::steady_clock::now();
+
+    if( _file_format == FileFormat::MAT73 ){
+
+        _stream_mat = Mat_CreateVer(segment_file().c_str(), nullptr, MAT_FT_MAT73);
+
+        if( !_stream_mat ){
+            Logger::error() << "Unable to create MAT file " << segment_file() << Logger::endl();
+            _segment = 0;
+            return false;
+        }
+    }
+    else{
+
+        _stream_dir = _file_name + ".stream";
+
+        if( mkdir(_stream_dir.c_str(), 0755) != 0 && errno != EEXIST ){
+            Logger::error() << "Unable to create directory " << _stream_dir << ": " << strerror(errno) << Logger::endl();
+            return false;
+        }
+    }
+
+    _stream_opts = options;
+    _streaming = true;
+
+    if( _segment != 0 && _file_format == FileFormat::MAT5 ){
+        _seal_run = true;
+        _seal_thread = std::thread(&MatLogger::seal_loop, this);
+    }
+
+    _stream_run = true;
+    _stream_thread = std::thread(&MatLogger::stream_loop, this);
+
+    return true;
+}
+
+bool MatLogger::setFileFormat(FileFormat format)
+{
+    if( _streaming || _flushed ){
+        Logger::error() << "File format must be set before streaming starts and before flushing" << Logger::endl();
+        return false;
+    }
+
+    _file_format = format;
+
+    return true;
+}
+
+bool MatLogger::enableTimestamps(int buffer_size)
+{
+    if( _time_track ){
+        Logger::error() << "Timestamps already enabled for " << _file_name << Logger::endl();
+        return false;
+    }
+
+    if( !_vars.empty() || _flushed ){
+        Logger::error() << "Timestamps must be enabled before creating any variable" << Logger::endl();
+        return false;
+    }
+
+    if( buffer_size <= 0 || buffer_size > (1 << 30) ){
+        Logger::error() << "Invalid size for the timestamp track" << Logger::endl();
+        return false;
+    }
+
+    // power of two, so that the track stays contiguous when the 32-bit tick counter wraps
+    uint32_t capacity = 1;
+    while( capacity < (uint32_t)buffer_size ){
+        capacity <<= 1;
+    }
+
+    std::vector<char> desc;
+    put_int(desc, capacity);
+    _time_header = ring_header(time_magic, desc);
+
+    if( !_ring_dir.empty() ){
+        return map_time_ring(capacity);
+    }
+
+    _time_track.reset(new std::atomic<uint64_t>[capacity], std::default_delete<std::atomic<uint64_t>[]>());
+    _time_mask = capacity - 1;
+    _tick = &_tick_counter;
+    _tick->store(0);
+
+    for( uint32_t i = 0; i < capacity; i++ ){
+        _time_track.get()[i].store(0, std::memory_order_relaxed);
+    }
+
+    return true;
+}
+
+double MatLogger::tick_time(uint32_t tick) const
+{
+    // tick zero means that no timestamp was available when the sample was added
+    if( tick == 0 ){
+        return NAN;
+    }
+
+    uint64_t time_ns = _time_track.get()[(tick - 1) & _time_mask].load(std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // the slot may have been reused by a later tick
+    if( _tick->load(std::memory_order_relaxed) - tick > _time_mask ){
+        return NAN;
+    }
+
+    return time_ns * 1e-9;
+}
+
+void MatLogger::get_times(const VariableInfo& varinfo, uint64_t first_slot, uint64_t n_samples, double * times) const
+{
+    const uint32_t * ticks = varinfo.ticks.get();
+
+    for( uint64_t i = 0; i < n_samples; i++ ){
+        times[i] = tick_time(ticks[(first_slot + i) % varinfo.buffer_capacity]);
+    }
+}
+
+uint64_t MatLogger::getDroppedSamples() const
+{
+    uint64_t dropped = 0;
+
+    for( const VariableInfo& varinfo : _vars ){
+        if( varinfo.stream ){
+            dropped += varinfo.stream->dropped.load(std::memory_order_relaxed);
+        }
+    }
+
+    for( const auto& queue : _producers ){
+        dropped += queue->dropped.load(std::memory_order_relaxed);
+    }
+
+    return dropped;
+}
+
+bool MatLogger::setAllocationMode(AllocationMode mode)
+{
+    if( !_vars.empty() || _arena || _flushed ){
+        Logger::error() << "Allocation mode must be set before creating any variable and before setting the memory budget" << Logger::endl();
+        return false;
+    }
+
+    _alloc_mode = mode;
+
+    return true;
+}
+
+std::shared_ptr<char> MatLogger::allocate_buffer(std::size_t bytes) const
+{
+    if( _alloc_mode == AllocationMode::Default ){
+        return std::shared_ptr<char>(new (std::nothrow) char[bytes](), std::default_delete<char[]>());
+    }
+
+    const std::size_t huge_page = 2*1024*1024;
+    void * data = MAP_FAILED;
+
+    // explicit huge pages are only available if reserved by the administrator
+    if( _alloc_mode == AllocationMode::HugePages && bytes >= huge_page ){
+
+        std::size_t huge_bytes = (bytes + huge_page - 1) / huge_page * huge_page;
+
+        data = mmap(nullptr, huge_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if( data != MAP_FAILED ){
+            bytes = huge_bytes;
+        }
+    }
+
+    if( data == MAP_FAILED ){
+
+        data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if( data == MAP_FAILED ){
+            Logger::error() << "Unable to map " << bytes << " bytes: " << strerror(errno) << Logger::endl();
+            return std::shared_ptr<char>();
+        }
+
+        // must be requested before the pages are faulted in by mlock()
+        if( _alloc_mode == AllocationMode::HugePages && bytes >= huge_page ){
+            madvise(data, bytes, MADV_HUGEPAGE);
+        }
+    }
+
+    // mlock() also prefaults the whole buffer
+    if( mlock(data, bytes) != 0 ){
+        Logger::error() << "Unable to lock " << bytes << " bytes in memory: " << strerror(errno) <<
+            " (check RLIMIT_MEMLOCK)" << Logger::endl();
+        munmap(data, bytes);
+        return std::shared_ptr<char>();
+    }
+
+    return std::shared_ptr<char>((char *)data, [bytes](char * ptr){ munmap(ptr, bytes); });
+}
+
+bool MatLogger::allocate_storage(VariableInfo& varinfo, const std::string& ring)
+{
+    // depth decided by the memory budget, see allocateBuffers()
+    if( varinfo.buffer_capacity == 0 ){
+        return true;
+    }
+
+    varinfo.header = ring_header(ring_magic, ring_description(varinfo));
+
+    if( !_ring_dir.empty() ){
+        return map_ring(varinfo, ring.empty() ? ring_file(_var_idx_map.at(varinfo.name)) : ring);
+    }
+
+    std::size_t ticks_bytes = sizeof(uint32_t) * varinfo.buffer_capacity;
+    std::shared_ptr<char> ticks;
+
+    if( _arena ){
+        varinfo.data = carve((size_t)varinfo.sample_bytes * varinfo.buffer_capacity);
+        ticks = _time_track && varinfo.data ? carve(ticks_bytes) : nullptr;
+    }
+    else{
+        varinfo.data = allocate_buffer((size_t)varinfo.sample_bytes * varinfo.buffer_capacity);
+        ticks = _time_track && varinfo.data ? allocate_buffer(ticks_bytes) : nullptr;
+    }
+
+    varinfo.ticks = std::shared_ptr<uint32_t>(ticks, (uint32_t *)ticks.get());
+
+    if( !varinfo.data || (_time_track && !ticks) ){
+        Logger::error() << "Unable to allocate the buffer of variable " << varinfo.name << Logger::endl();
+        varinfo.data.reset();
+        varinfo.ticks.reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool MatLogger::enableCrashRecovery()
+{
+    if( !_ring_dir.empty() ){
+        Logger::error() << "Crash recovery already enabled for " << _file_name << Logger::endl();
+        return false;
+    }
+
+    if( !_vars.empty() || _time_track || _flushed ){
+        Logger::error() << "Crash recovery must be enabled before creating any variable and before enabling timestamps" << Logger::endl();
+        return false;
+    }
+
+    if( _streaming || _arena ){
+        Logger::error() << "Crash recovery is not available in streaming mode and with a memory budget" << Logger::endl();
+        return false;
+    }
+
+    if( mkdir(_dump_dir.c_str(), 0755) != 0 && errno != EEXIST ){
+        Logger::error() << "Unable to create directory " << _dump_dir << ": " << strerror(errno) << Logger::endl();
+        return false;
+    }
+
+    _ring_dir = _dump_dir;
+
+    Logger::info() << "Buffers of " << _file_name << " are mapped to " << _ring_dir <<
+        ", run xbot_mat_recover on it after a crash" << Logger::endl();
+
+    return true;
+}
+
+std::string MatLogger::ring_file(int idx) const
+{
+    return _ring_dir + "/" + std::to_string(idx) + ".ring";
+}
+
+std::vector<char> MatLogger::ring_header(const char * magic, const std::vector<char>& desc)
+{
+    std::vector<char> header(sizeof(RingHeader) + desc.size(), 0);
+    std::size_t page = sysconf(_SC_PAGESIZE);
+
+    RingHeader * ring_header = (RingHeader *)header.data();
+    memcpy(ring_header->magic, magic, sizeof(ring_header->magic));
+    ring_header->version = ring_version;
+    ring_header->header_bytes = (header.size() + page - 1) / page * page;
+    ring_header->desc_bytes = desc.size();
+
+    memcpy(header.data() + sizeof(RingHeader), desc.data(), desc.size());
+
+    uint32_t crc = crc32c(header.data(), (const char *)&ring_header->crc - header.data());
+    ring_header->crc = crc32c(desc.data(), desc.size(), crc);
+
+    return header;
+}
+
+std::shared_ptr<char> MatLogger::create_ring_file(const std::string& file, std::size_t bytes) const
+{
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if( fd < 0 ){
+        Logger::error() << "Unable to create " << file << ": " << strerror(errno) << Logger::endl();
+        return std::shared_ptr<char>();
+    }
+
+    // reserve the blocks now: a full disk must not turn into a SIGBUS inside add()
+    int ret = posix_fallocate(fd, 0, bytes);
+
+    void * data = MAP_FAILED;
+
+    if( ret == 0 ){
+        data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        ret = data == MAP_FAILED ? errno : 0;
+    }
+
+    ::close(fd);
+
+    if( ret == 0 && _alloc_mode != AllocationMode::Default && mlock(data, bytes) != 0 ){
+        ret = errno;
+        munmap(data, bytes);
+    }
+
+    if( ret != 0 ){
+        Logger::error() << "Unable to map " << bytes << " bytes of " << file << ": " << strerror(ret) << Logger::endl();
+        unlink(file.c_str());
+        return std::shared_ptr<char>();
+    }
+
+    return std::shared_ptr<char>((char *)data, [bytes](char * ptr){ munmap(ptr, bytes); });
+}
+
+std::vector<char> MatLogger::ring_description(const VariableInfo& varinfo) const
+{
+    std::vector<char> desc;
+
+    put_string(desc, varinfo.name);
+    put_int(desc, (int)varinfo.type);
+    put_int(desc, varinfo.class_type);
+    put_int(desc, varinfo.data_type);
+    put_int(desc, varinfo.logical);
+    put_int(desc, varinfo.rows);
+    put_int(desc, varinfo.cols);
+    put_int(desc, varinfo.sample_bytes);
+    put_int(desc, varinfo.buffer_capacity);
+    put_int(desc, varinfo.interleave);
+    put_int(desc, _time_track ? 1 : 0);
+    put_int(desc, varinfo.fields.size());
+
+    for( const FieldInfo& field : varinfo.fields ){
+        put_string(desc, field.name);
+        put_int(desc, (int)field.type);
+        put_int(desc, field.class_type);
+        put_int(desc, field.data_type);
+        put_int(desc, field.logical);
+        put_int(desc, field.rows);
+        put_int(desc, field.cols);
+        put_int(desc, field.offset);
+        put_int(desc, field.bytes);
+    }
+
+    return desc;
+}
+
+bool MatLogger::map_ring(VariableInfo& varinfo, const std::string& file)
+{
+    std::size_t header_bytes = ((const RingHeader *)varinfo.header.data())->header_bytes;
+    std::size_t data_bytes = (std::size_t)varinfo.sample_bytes * varinfo.buffer_capacity;
+    std::size_t ticks_bytes = _time_track ? sizeof(uint32_t) * varinfo.buffer_capacity : 0;
+
+    std::shared_ptr<char> ring = create_ring_file(file, header_bytes + data_bytes + ticks_bytes);
+
+    if( !ring ){
+        Logger::error() << "Unable to allocate the buffer of variable " << varinfo.name << Logger::endl();
+        return false;
+    }
+
+    RingHeader * header = (RingHeader *)ring.get();
+    memcpy(ring.get(), varinfo.header.data(), varinfo.header.size());
+
+    varinfo.data = std::shared_ptr<char>(ring, ring.get() + header_bytes);
+    varinfo.ring_written = &header->written;
+
+    if( _time_track ){
+        varinfo.ticks = std::shared_ptr<uint32_t>(ring, (uint32_t *)(ring.get() + header_bytes + data_bytes));
+    }
+
+    return true;
+}
+
+bool MatLogger::map_time_ring(uint32_t capacity)
+{
+    std::size_t header_bytes = ((const RingHeader *)_time_header.data())->header_bytes;
+
+    std::shared_ptr<char> ring = create_ring_file(_ring_dir + "/time.ring", header_bytes + sizeof(uint64_t) * capacity);
+
+    if( !ring ){
+        return false;
+    }
+
+    RingHeader * header = (RingHeader *)ring.get();
+    memcpy(ring.get(), _time_header.data(), _time_header.size());
+
+    _time_track = std::shared_ptr<std::atomic<uint64_t>>(ring, (std::atomic<uint64_t> *)(ring.get() + header_bytes));
+    _time_mask = capacity - 1;
+    _tick = &header->tick;
+
+    return true;
+}
+
+std::shared_ptr<char> MatLogger::open_ring_file(const std::string& file, const char * magic, std::vector<char>& desc, std::size_t& bytes)
+{
+    int fd = ::open(file.c_str(), O_RDONLY);
+
+    if( fd < 0 ){
+        Logger::warning() << "Unable to open " << file << ": " << strerror(errno) << Logger::endl();
+        return std::shared_ptr<char>();
+    }
+
+    struct stat st;
+    void * data = MAP_FAILED;
+
+    if( fstat(fd, &st) == 0 && (std::size_t)st.st_size >= sizeof(RingHeader) ){
+        // private mapping: buffers are rearranged in place, the file is left untouched
+        data = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+
+    ::close(fd);
+
+    if( data == MAP_FAILED ){
+        Logger::warning() << "Unable to map " << file << Logger::endl();
+        return std::shared_ptr<char>();
+    }
+
+    bytes = st.st_size;
+    std::shared_ptr<char> ring((char *)data, [bytes](char * ptr){ munmap(ptr, bytes); });
+
+    const RingHeader * header = (const RingHeader *)ring.get();
+
+    if( memcmp(header->magic, magic, sizeof(header->magic)) != 0 || header->version != ring_version ||
+        header->header_bytes > bytes || sizeof(RingHeader) + header->desc_bytes > header->header_bytes ){
+        Logger::warning() << file << " is not a valid ring file" << Logger::endl();
+        return std::shared_ptr<char>();
+    }
+
+    const char * desc_data = ring.get() + sizeof(RingHeader);
+    uint32_t crc = crc32c((const char *)header, (const char *)&header->crc - (const char *)header);
+
+    if( crc32c(desc_data, header->desc_bytes, crc) != header->crc ){
+        Logger::warning() << "Header of " << file << " is damaged" << Logger::endl();
+        return std::shared_ptr<char>();
+    }
+
+    desc.assign(desc_data, desc_data + header->desc_bytes);
+
+    return ring;
+}
+
+bool MatLogger::load_ring(const std::string& file, VariableInfo& varinfo)
+{
+    std::vector<char> desc;
+    std::size_t bytes = 0;
+
+    std::shared_ptr<char> ring = open_ring_file(file, ring_magic, desc, bytes);
+
+    if( !ring ){
+        return false;
+    }
+
+    const char * ptr = desc.data();
+    const char * end = ptr + desc.size();
+    int type = 0, has_ticks = 0, n_fields = 0;
+
+    bool ok = get_string(ptr, end, varinfo.name) &&
+              get_int(ptr, end, type) &&
+              get_int(ptr, end, varinfo.class_type) &&
+              get_int(ptr, end, varinfo.data_type) &&
+              get_int(ptr, end, varinfo.logical) &&
+              get_int(ptr, end, varinfo.rows) &&
+              get_int(ptr, end, varinfo.cols) &&
+              get_int(ptr, end, varinfo.sample_bytes) &&
+              get_int(ptr, end, varinfo.buffer_capacity) &&
+              get_int(ptr, end, varinfo.interleave) &&
+              get_int(ptr, end, has_ticks) &&
+              get_int(ptr, end, n_fields);
+
+    for( int i = 0; ok && i < n_fields; i++ ){
+
+        FieldInfo field;
+        int field_type = 0;
+
+        ok = get_string(ptr, end, field.name) &&
+             get_int(ptr, end, field_type) &&
+             get_int(ptr, end, field.class_type) &&
+             get_int(ptr, end, field.data_type) &&
+             get_int(ptr, end, field.logical) &&
+             get_int(ptr, end, field.rows) &&
+             get_int(ptr, end, field.cols) &&
+             get_int(ptr, end, field.offset) &&
+             get_int(ptr, end, field.bytes);
+
+        field.type = (VariableType)field_type;
+        varinfo.fields.push_back(field);
+    }
+
+    const RingHeader * header = (const RingHeader *)ring.get();
+    std::size_t data_bytes = (std::size_t)varinfo.sample_bytes * varinfo.buffer_capacity;
+    std::size_t ticks_bytes = has_ticks ? sizeof(uint32_t) * varinfo.buffer_capacity : 0;
+
+    if( !ok || varinfo.sample_bytes <= 0 || varinfo.buffer_capacity <= 0 ||
+        header->header_bytes + data_bytes + ticks_bytes > bytes ){
+        Logger::warning() << "Description of " << file << " is damaged" << Logger::endl();
+        return false;
+    }
+
+    varinfo.type = (VariableType)type;
+    varinfo.count = -1;
+    varinfo.data = std::shared_ptr<char>(ring, ring.get() + header->header_bytes);
+
+    if( has_ticks ){
+        varinfo.ticks = std::shared_ptr<uint32_t>(ring, (uint32_t *)(varinfo.data.get() + data_bytes));
+    }
+
+    // rebuild the circular buffer state from the number of committed samples
+    uint64_t written = header->written.load();
+
+    varinfo.empty = (written == 0);
+    varinfo.head = written <= (uint64_t)varinfo.buffer_capacity ? 0 : written % varinfo.buffer_capacity;
+    varinfo.tail = written <= (uint64_t)varinfo.buffer_capacity ? written : varinfo.head;
+
+    return true;
+}
+
+bool MatLogger::load_time_ring(const std::string& file)
+{
+    std::vector<char> desc;
+    std::size_t bytes = 0;
+
+    std::shared_ptr<char> ring = open_ring_file(file, time_magic, desc, bytes);
+
+    if( !ring ){
+        return false;
+    }
+
+    const char * ptr = desc.data();
+    int64_t capacity = 0;
+    RingHeader * header = (RingHeader *)ring.get();
+
+    if( !get_int(ptr, ptr + desc.size(), capacity) || capacity <= 0 || (capacity & (capacity - 1)) != 0 ||
+        header->header_bytes + sizeof(uint64_t) * capacity > bytes ){
+        Logger::warning() << "Description of " << file << " is damaged" << Logger::endl();
+        return false;
+    }
+
+    _time_track = std::shared_ptr<std::atomic<uint64_t>>(ring, (std::atomic<uint64_t> *)(ring.get() + header->header_bytes));
+    _time_mask = capacity - 1;
+    _tick = &header->tick;
+
+    return true;
+}
+
+bool MatLogger::recover(const std::string& ring_dir, const std::string& mat_file)
+{
+    std::string dir = ring_dir;
+
+    while( dir.size() > 1 && dir.back() == '/' ){
+        dir.pop_back();
+    }
+
+    // by default, the mat file of the crashed logger
+    std::string file_name = mat_file;
+    const std::string suffix = ".rings";
+
+    if( file_name.empty() ){
+        bool has_suffix = dir.size() > suffix.size() && dir.compare(dir.size() - suffix.size(), suffix.size(), suffix) == 0;
+        file_name = has_suffix ? dir.substr(0, dir.size() - suffix.size()) : dir + ".mat";
+    }
+
+    DIR * dir_stream = opendir(dir.c_str());
+
+    if( !dir_stream ){
+        Logger::error() << "Unable to open directory " << dir << ": " << strerror(errno) << Logger::endl();
+        return false;
+    }
+
+    std::vector<int> indices;
+
+    while( struct dirent * entry = readdir(dir_stream) ){
+
+        char * end = nullptr;
+        long idx = strtol(entry->d_name, &end, 10);
+
+        if( end != entry->d_name && idx >= 0 && std::string(end) == ".ring" ){
+            indices.push_back(idx);
+        }
+    }
+
+    closedir(dir_stream);
+
+    std::sort(indices.begin(), indices.end());
+
+    MatLogger logger(file_name);
+    logger._file_name = file_name;
+    logger._flushed = true;
+
+    std::string time_file = dir + "/time.ring";
+
+    if( access(time_file.c_str(), F_OK) == 0 && !logger.load_time_ring(time_file) ){
+        Logger::warning() << "Timestamps are not available" << Logger::endl();
+    }
+
+    for( int idx : indices ){
+
+        // loaded in place, variables cannot be moved
+        logger._vars.emplace_back();
+
+        VariableInfo& varinfo = logger._vars.back();
+        std::string file = dir + "/" + std::to_string(idx) + ".ring";
+
+        if( !load_ring(file, varinfo) ){
+            Logger::warning() << "Skipping " << file << Logger::endl();
+            logger._vars.pop_back();
+            continue;
+        }
+
+        if( logger._var_idx_map.count(varinfo.name) ){
+            Logger::warning() << "Skipping " << file << ": duplicate variable " << varinfo.name << Logger::endl();
+            logger._vars.pop_back();
+            continue;
+        }
+
+        if( !logger._time_track ){
+            varinfo.ticks.reset();
+        }
+
+        int new_idx = logger._vars.size() - 1;
+        logger._var_idx_map[varinfo.name] = new_idx;
+
+        for( const FieldInfo& field : varinfo.fields ){
+            logger._var_idx_map[field.name] = new_idx;
+        }
+    }
+
+    if( logger._vars.empty() ){
+        Logger::error() << "No variable found inside " << dir << Logger::endl();
+        return false;
+    }
+
+    Logger::info() << "Recovered " << logger._vars.size() << " variables from " << dir << Logger::endl();
+
+    return logger.dump();
+}
+
+bool MatLogger::merge(const std::vector<std::string>& segments, const std::string& mat_file)
+{
+    std::vector<MatVariable> vars;
+    std::vector<std::vector<unsigned int>> var_segments;     // segments containing each variable
+    std::unordered_map<std::string, int> var_idx;
+    enum mat_ft version = MAT_FT_MAT5;
+    bool version_set = false;
+
+    // first pass: only the headers of the variables are read, to find the size of the result
+    for( unsigned int k = 0; k < segments.size(); k++ ){
+
+        mat_t * segment = Mat_Open(segments[k].c_str(), MAT_ACC_RDONLY);
+
+        if( !segment ){
+            Logger::warning() << "Skipping " << segments[k] << ": unable to open MAT file" << Logger::endl();
+            continue;
+        }
+
+        // the output file has the format of the first segment
+        if( !version_set ){
+            version = Mat_GetVersion(segment);
+            version_set = true;
+        }
+
+        while( matvar_t * mat_var = Mat_VarReadNextInfo(segment) ){
+
+            enum matio_types data_type = class_data_type(mat_var->class_type);
+            int rank = mat_var->rank;
+
+            if( rank < 2 || rank > 3 || mat_var->isComplex || data_type == MAT_T_UNKNOWN ){
+                Logger::warning() << "Skipping variable " << mat_var->name << " of " << segments[k] <<
+                    ": unsupported type" << Logger::endl();
+                Mat_VarFree(mat_var);
+                continue;
+            }
+
+            auto it = var_idx.find(mat_var->name);
+
+            if( it == var_idx.end() ){
+
+                MatVariable var;
+                var.name = mat_var->name;
+                var.class_type = mat_var->class_type;
+                var.data_type = data_type;
+                var.logical = mat_var->isLogical != 0;
+                var.rank = rank;
+                std::copy(mat_var->dims, mat_var->dims + rank, var.dims);
+                var.dims[rank-1] = 0;
+                var.data = nullptr;
+                var.bytes = 0;
+                var.compression = Compression::Default;
+
+                it = var_idx.emplace(var.name, vars.size()).first;
+                vars.push_back(var);
+                var_segments.emplace_back();
+            }
+
+            MatVariable& var = vars[it->second];
+
+            if( var.class_type != mat_var->class_type || var.rank != rank ||
+                !std::equal(var.dims, var.dims + rank - 1, mat_var->dims) ){
+                Logger::warning() << "Skipping variable " << mat_var->name << " of " << segments[k] <<
+                    ": type or size differ from the previous segments" << Logger::endl();
+                Mat_VarFree(mat_var);
+                continue;
+            }
+
+            var.dims[rank-1] += mat_var->dims[rank-1];
+            var_segments[it->second].push_back(k);
+
+            Mat_VarFree(mat_var);
+        }
+
+        Mat_Close(segment);
+    }
+
+    if( vars.empty() ){
+        Logger::error() << "No variable found inside the segments" << Logger::endl();
+        return false;
+    }
+
+    // second pass: each variable is copied one segment at a time, so that at most
+    // one segment of one variable is held in memory
+    mat_t * out = Mat_CreateVer(mat_file.c_str(), nullptr, version == MAT_FT_MAT73 ? MAT_FT_MAT73 : MAT_FT_MAT5);
+
+    if( !out ){
+        Logger::error() << "Unable to create MAT file " << mat_file << Logger::endl();
+        return false;
+    }
+
+    // MAT v5: the file header is written by matio, variables are then appended to it
+    int fd = -1;
+
+    if( version != MAT_FT_MAT73 ){
+
+        Mat_Close(out);
+        out = nullptr;
+
+        // not O_APPEND: the size of compressed elements is written once they are complete
+        fd = ::open(mat_file.c_str(), O_WRONLY);
+
+        if( fd < 0 ){
+            Logger::error() << "Unable to open MAT file " << mat_file << ": " << strerror(errno) << Logger::endl();
+            return false;
+        }
+    }
+
+    bool ok = true;
+
+    for( unsigned int i = 0; i < vars.size(); i++ ){
+
+        MatVariable& var = vars[i];
+        std::size_t sample_bytes = Mat_SizeOf(var.data_type);
+
+        for( int d = 0; d < var.rank - 1; d++ ){
+            sample_bytes *= var.dims[d];
+        }
+
+        var.bytes = sample_bytes * var.dims[var.rank-1];
+
+        Logger::info() << "Writing variable " << var.name << " to mat file..." << Logger::endl();
+
+        Mat5Stream element(fd);
+        std::vector<char> header;
+
+        if( fd >= 0 && (!mat5_header(var, header) || !element.begin(header, Z_DEFAULT_COMPRESSION)) ){
+            Logger::error() << "Unable to write variable " << var.name << " to mat file " <<
+                "(MAT5 variables are limited to 2 GB, consider FileFormat::MAT73)" << Logger::endl();
+            element.abort();
+            ok = false;
+            continue;
+        }
+
+        std::size_t written = 0;
+
+        for( unsigned int k : var_segments[i] ){
+
+            mat_t * segment = Mat_Open(segments[k].c_str(), MAT_ACC_RDONLY);
+            matvar_t * mat_var = segment ? Mat_VarRead(segment, var.name.c_str()) : nullptr;
+
+            if( segment ){
+                Mat_Close(segment);
+            }
+
+            std::size_t samples = mat_var ? mat_var->dims[var.rank-1] : 0;
+            std::size_t bytes = sample_bytes * samples;
+
+            if( !mat_var || mat_var->data_type != var.data_type || (bytes > 0 && !mat_var->data) ||
+                written + bytes > var.bytes ){
+                Logger::error() << "Unable to read variable " << var.name << " of " << segments[k] << Logger::endl();
+                Mat_VarFree(mat_var);
+                break;
+            }
+
+            bool piece_ok = true;
+
+            // samples are stored along the last dimension, i.e. contiguously at the end
+            if( bytes > 0 && fd >= 0 ){
+                piece_ok = element.write((const char *)mat_var->data, bytes);
+            }
+            else if( bytes > 0 ){
+
+                MatVariable piece = var;
+                piece.dims[var.rank-1] = samples;
+                piece.data = mat_var->data;
+                piece.bytes = bytes;
+
+                matvar_t * piece_var = create_mat_var(piece);
+                piece_ok = Mat_VarWriteAppend(out, piece_var, to_matio_compression(var.compression), var.rank) == 0;
+                Mat_VarFree(piece_var);
+            }
+
+            Mat_VarFree(mat_var);
+
+            if( !piece_ok ){
+                Logger::error() << "Unable to write variable " << var.name << " to mat file " << mat_file << Logger::endl();
+                break;
+            }
+
+            written += bytes;
+        }
+
+        // a variable which has not been copied entirely is left out of a MAT v5 file
+        if( written != var.bytes ){
+            element.abort();
+            ok = false;
+        }
+        else if( fd >= 0 ){
+            ok = element.end(mat5_padding(var.bytes)) && ok;
+        }
+        else if( var.bytes == 0 ){
+
+            matvar_t * mat_var = create_mat_var(var);
+            ok = Mat_VarWrite(out, mat_var, to_matio_compression(var.compression)) == 0 && ok;
+            Mat_VarFree(mat_var);
+        }
+    }
+
+    if( out ){
+        Mat_Close(out);
+    }
+
+    if( fd >= 0 ){
+        ::close(fd);
+    }
+
+    if( ok ){
+        Logger::success() << "Merged " << segments.size() << " segments into " << mat_file << Logger::endl();
+    }
+
+    return ok;
+}
+
+bool MatLogger::write_ring(const char * file, const std::vector<char>& header, uint64_t written, uint32_t tick,
+                           const char * data, std::size_t data_bytes, const char * ticks, std::size_t ticks_bytes)
+{
+    const RingHeader * ring_header = (const RingHeader *)header.data();
+
+    int fd = ::open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if( fd < 0 ){
+        return false;
+    }
+
+    // counters are not part of the header image
+    off_t written_offset = (const char *)&ring_header->written - header.data();
+    off_t tick_offset = (const char *)&ring_header->tick - header.data();
+
+    bool ok = write_all(fd, header.data(), header.size()) &&
+              lseek(fd, written_offset, SEEK_SET) >= 0 && write_all(fd, (const char *)&written, sizeof(written)) &&
+              lseek(fd, tick_offset, SEEK_SET) >= 0 && write_all(fd, (const char *)&tick, sizeof(tick)) &&
+              lseek(fd, ring_header->header_bytes, SEEK_SET) >= 0 &&
+              write_all(fd, data, data_bytes) &&
+              write_all(fd, ticks, ticks_bytes);
+
+    ::close(fd);
+
+    return ok;
+}
+
+void MatLogger::register_signal_logger()
+{
+    for( auto& slot : signal_loggers ){
+
+        MatLogger * empty = nullptr;
+
+        if( slot.compare_exchange_strong(empty, this) ){
+            return;
+        }
+    }
+
+    Logger::warning() << "Too many loggers, the emergency dump is not available for " << _file_name << Logger::endl();
+}
+
+void MatLogger::emergency_dump()
+{
+    // ring files are already on disk, and streamed data belong to the writer thread
+    if( _streaming || !_ring_dir.empty() ){
+        return;
+    }
+
+    // pairs with dump(): either the flusher waits for the raw dump before rotating
+    // the buffers in place, or the raw dump sees that it has started doing so
+    _dumping = true;
+
+    if( !_rearranging ){
+        write_raw_dump();
+    }
+
+    _dumping = false;
+}
+
+void MatLogger::write_raw_dump() const
+{
+    if( mkdir(_dump_dir.c_str(), 0755) != 0 && errno != EEXIST ){
+        return;
+    }
+
+    char file[PATH_MAX];
+
+    for( unsigned int i = 0; i < _vars.size(); i++ ){
+
+        const VariableInfo& varinfo = _vars[i];
+
+        // compressed blocks cannot be described by a ring file, and the interrupted thread might have left a sample halfway
+        if( !varinfo.data || varinfo.header.empty() || varinfo.compressed || varinfo.writing.load() ||
+            !make_path(file, sizeof(file), _dump_dir, i, nullptr, ".ring") )
+        {
+            continue;
+        }
+
+        // number of samples which lead to the current head and tail (see load_ring())
+        uint64_t written = 0;
+
+        if( !varinfo.empty ){
+            written = varinfo.tail > varinfo.head ? varinfo.tail : (uint64_t)varinfo.buffer_capacity + varinfo.head;
+        }
+
+        write_ring(file, varinfo.header, written, 0,
+                   varinfo.data.get(), (std::size_t)varinfo.sample_bytes * varinfo.buffer_capacity,
+                   (const char *)varinfo.ticks.get(), varinfo.ticks ? sizeof(uint32_t) * varinfo.buffer_capacity : 0);
+    }
+
+    if( _time_track && make_path(file, sizeof(file), _dump_dir, 0, "time", ".ring") ){
+        write_ring(file, _time_header, 0, _tick->load(),
+                   (const char *)_time_track.get(), sizeof(uint64_t) * (_time_mask + 1), nullptr, 0);
+    }
+}
+
+bool MatLogger::installSignalHandlers(int timeout_ms)
+{
+    if( timeout_ms < 0 ){
+        Logger::error() << "Invalid timeout for the emergency flush" << Logger::endl();
+        return false;
+    }
+
+    if( signal_handlers_installed.exchange(true) ){
+        Logger::error() << "Signal handlers already installed" << Logger::endl();
+        return false;
+    }
+
+    flush_timeout_ms = timeout_ms;
+    sem_init(&flush_request, 0, 0);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &MatLogger::signal_handler;
+    sigemptyset(&action.sa_mask);
+
+    // a second signal while flushing reaches the previous disposition (e.g. a second Ctrl-C)
+    action.sa_flags = SA_NODEFER;
+
+    for( int i = 0; i < n_handled_signals; i++ ){
+
+        sigaction(handled_signals[i], nullptr, &previous_actions[i]);
+
+        // signals ignored by the application stay ignored
+        if( previous_actions[i].sa_handler == SIG_IGN ){
+            continue;
+        }
+
+        if( sigaction(handled_signals[i], &action, nullptr) != 0 ){
+
+            Logger::error() << "Unable to install the handler of signal " << handled_signals[i] << ": " << strerror(errno) << Logger::endl();
+
+            // leave the application with the dispositions it had before the call
+            for( int j = 0; j < i; j++ ){
+                if( previous_actions[j].sa_handler != SIG_IGN ){
+                    sigaction(handled_signals[j], &previous_actions[j], nullptr);
+                }
+            }
+
+            sem_destroy(&flush_request);
+            signal_handlers_installed = false;
+
+            return false;
+        }
+    }
+
+    std::thread(&MatLogger::signal_flusher).detach();
+
+    return true;
+}
+
+void MatLogger::signal_flusher()
+{
+    block_signals();
+
+    while( sem_wait(&flush_request) != 0 ){
+    }
+
+    FlushAll();
+
+    flush_done = true;
+}
+
+void MatLogger::signal_handler(int sig)
+{
+    if( !handling_signal.exchange(true) ){
+
+        bool flushed = false;
+
+        // after a SIGSEGV the heap cannot be trusted: only the raw dump is attempted
+        if( sig != SIGSEGV ){
+
+            // only async-signal-safe calls: sem_post(), clock_gettime() and nanosleep()
+            timespec now, deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += flush_timeout_ms / 1000;
+            deadline.tv_nsec += (flush_timeout_ms % 1000) * 1000000L;
+
+            if( deadline.tv_nsec >= 1000000000L ){
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            sem_post(&flush_request);
+
+            const timespec poll_period = {0, 1000000L};
+
+            while( !(flushed = flush_done.load()) ){
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+
+                if( now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec) ){
+                    break;
+                }
+
+                nanosleep(&poll_period, nullptr);
+            }
+        }
+
+        // the flusher may be blocked by a lock held by the interrupted thread
+        if( !flushed ){
+            for( auto& slot : signal_loggers ){
+
+                MatLogger * logger = slot.load();
+
+                if( logger ){
+                    logger->emergency_dump();
+                }
+            }
+        }
+    }
+
+    for( int i = 0; i < n_handled_signals; i++ ){
+        if( handled_signals[i] == sig ){
+            sigaction(sig, &previous_actions[i], nullptr);
+        }
+    }
+
+    raise(sig);
+}
+
+bool MatLogger::setMemoryBudget(std::size_t bytes)
+{
+    if( _arena ){
+        Logger::error() << "Memory budget already set for " << _file_name << Logger::endl();
+        return false;
+    }
+
+    if( !_vars.empty() || _flushed ){
+        Logger::error() << "Memory budget must be set before creating any variable" << Logger::endl();
+        return false;
+    }
+
+    if( !_ring_dir.empty() ){
+        Logger::error() << "Memory budget is not available with crash recovery" << Logger::endl();
+        return false;
+    }
+
+    if( bytes == 0 ){
+        Logger::error() << "Invalid memory budget" << Logger::endl();
+        return false;
+    }
+
+    _arena = allocate_buffer(bytes);
+
+    if( !_arena ){
+        Logger::error() << "Unable to allocate a memory budget of " << bytes << " bytes" << Logger::endl();
+        return false;
+    }
+
+    _arena_size = bytes;
+    _arena_used = 0;
+    _arena_reserved = 0;
+
+    return true;
+}
+
+std::size_t MatLogger::buffer_bytes(int sample_bytes, int buffer_capacity) const
+{
+    std::size_t bytes = (std::size_t)sample_bytes * buffer_capacity;
+
+    if( _time_track ){
+        bytes += sizeof(uint32_t) * buffer_capacity;
+    }
+
+    return bytes;
+}
+
+int MatLogger::min_buffer_size() const
+{
+    return _streaming ? 2*_stream_opts.chunks_per_buffer : 2;
+}
+
+std::shared_ptr<char> MatLogger::carve(std::size_t bytes)
+{
+    // every buffer starts on a cache line
+    std::size_t offset = (_arena_used + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+    if( offset > _arena_size || bytes > _arena_size - offset ){
+        return std::shared_ptr<char>();
+    }
+
+    _arena_used = offset + bytes;
+
+    char * data = _arena.get() + offset;
+
+    // locked arenas are already zeroed
+    if( _alloc_mode == AllocationMode::Default ){
+        memset(data, 0, bytes);
+    }
+
+    // shares the ownership of the whole arena
+    return std::shared_ptr<char>(_arena, data);
+}
+
+bool MatLogger::plan_buffer(const std::string& name, int sample_bytes, int default_size, int& buffer_size)
+{
+    if( !_arena ){
+        if( buffer_size < 0 ){
+            buffer_size = default_size;
+        }
+        return true;
+    }
+
+    // each buffer (and its timestamp indices) may waste up to ARENA_ALIGNMENT bytes
+    std::size_t required = buffer_bytes(sample_bytes, buffer_size < 0 ? min_buffer_size() : buffer_size) + 2*ARENA_ALIGNMENT;
+    std::size_t available = _arena_size - std::min(_arena_size, _arena_used + _arena_reserved);
+
+    if( required > available ){
+        Logger::error() << "Variable " << name << " requires at least " << required << " bytes, but only " <<
+            available << " bytes of the memory budget of " << _file_name << " are left" << Logger::endl();
+        return false;
+    }
+
+    if( buffer_size < 0 ){
+        _arena_reserved += required;
+        buffer_size = 0;
+    }
+
+    return true;
+}
+
+bool MatLogger::allocateBuffers()
+{
+    // the streaming writer reads the buffers of all variables
+    std::lock_guard<std::mutex> guard(_vars_mutex);
+
+    return allocate_buffers();
+}
+
+bool MatLogger::allocate_buffers()
+{
+    std::vector<VariableInfo *> pending;
+    double bytes_per_call = 0;
+
+    for( VariableInfo& varinfo : _vars ){
+        if( varinfo.buffer_capacity == 0 ){
+            pending.push_back(&varinfo);
+            bytes_per_call += (double)buffer_bytes(varinfo.sample_bytes, 1) / varinfo.interleave;
+        }
+    }
+
+    if( pending.empty() ){
+        return true;
+    }
+
+    // all pending variables retain the same number of calls to add() (i.e. the same time span)
+    std::size_t slack = 2*ARENA_ALIGNMENT*pending.size();
+    std::size_t available = _arena_size - std::min(_arena_size, _arena_used + slack);
+    double horizon = available / bytes_per_call;
+
+    bool ok = true;
+
+    for( VariableInfo * varinfo : pending ){
+
+        double depth = std::min<double>(varinfo->default_capacity, horizon / varinfo->interleave);
+        varinfo->buffer_capacity = std::max<int>(depth, min_buffer_size());
+
+        if( !allocate_storage(*varinfo) ){
+            varinfo->buffer_capacity = 0;
+            ok = false;
+        }
+    }
+
+    _arena_reserved = 0;
+
+    Logger::info() << "Memory budget of " << _file_name << ": " << _arena_used << " of " << _arena_size <<
+        " bytes allocated to " << _vars.size() << " variables" << Logger::endl();
+
+    return ok;
+}
+
+void MatLogger::report_unallocated(VariableInfo& varinfo)
+{
+    if( varinfo.unallocated_reported ){
+        return;
+    }
+
+    varinfo.unallocated_reported = true;
+
+    Logger::error() << "Buffer of variable " << varinfo.name << " has not been allocated: call allocateBuffers() " <<
+        "after creating all variables and before logging them" << Logger::endl();
+}
+
+std::vector<MatLogger::VariableMemory> MatLogger::getMemoryReport() const
+{
+    std::vector<VariableMemory> report;
+
+    for( const VariableInfo& varinfo : _vars ){
+
+        VariableMemory memory;
+        memory.name = varinfo.name;
+        memory.sample_bytes = varinfo.sample_bytes;
+        memory.buffer_capacity = varinfo.data ? varinfo.buffer_capacity : 0;
+        memory.bytes = buffer_bytes(varinfo.sample_bytes, memory.buffer_capacity);
+
+        // the number of samples which fit into the blocks depends on how well they compress
+        if( varinfo.compressed ){
+
+            const CompressedRing& ring = *varinfo.compressed;
+
+            memory.buffer_capacity = 0;
+            memory.bytes = (std::size_t)ring.n_blocks * ring.block_bytes;
+
+            for( int i = 0; i < ring.used_blocks; i++ ){
+
+                uint32_t n_samples;
+                memcpy(&n_samples, varinfo.data.get() + (size_t)((ring.first_block + i) % ring.n_blocks) * ring.block_bytes, sizeof(n_samples));
+
+                memory.buffer_capacity += n_samples;
+            }
+        }
+
+        report.push_back(memory);
+    }
+
+    return report;
+}
+
+MatLogger::Producer MatLogger::createProducer(int queue_size)
+{
+    if( queue_size <= 0 || _flushed ){
+        Logger::error() << "Unable to create a producer for " << _file_name << Logger::endl();
+        return Producer();
+    }
+
+    std::lock_guard<std::mutex> guard(_vars_mutex);
+
+    if( _vars.empty() ){
+        Logger::error() << "Variables must be created before creating a producer" << Logger::endl();
+        return Producer();
+    }
+
+    allocate_buffers();
+
+    std::unique_ptr<ProducerQueue> queue(new ProducerQueue);
+    int max_sample_bytes = 0;
+
+    for( const VariableInfo& varinfo : _vars ){
+
+        SampleLayout layout;
+        layout.class_type = varinfo.class_type;
+        layout.logical = varinfo.logical;
+        layout.rows = varinfo.rows;
+        layout.cols = varinfo.cols;
+        layout.sample_bytes = varinfo.sample_bytes;
+
+        queue->layouts.push_back(layout);
+        max_sample_bytes = std::max(max_sample_bytes, varinfo.sample_bytes);
+    }
+
+    queue->slot_bytes = sizeof(ProducerQueue::SlotHeader) + (max_sample_bytes + 7) / 8 * 8;
+    queue->capacity = queue_size;
+    queue->slots = allocate_buffer((size_t)queue->slot_bytes * queue_size);
+
+    if( !queue->slots ){
+        Logger::error() << "Unable to allocate the queue of a producer" << Logger::endl();
+        return Producer();
+    }
+
+    _producers.push_back(std::move(queue));
+
+    if( !_consumer_thread.joinable() ){
+        _consumer_run = true;
+        _consumer_thread = std::thread(&MatLogger::consumer_loop, this);
+    }
+
+    return Producer(this, _producers.back().get());
+}
+
+char * MatLogger::Producer::reserve(int idx)
+{
+    if( !_queue || (unsigned int)idx >= _queue->layouts.size() ){
+        return nullptr;
+    }
+
+    uint64_t pushed = _queue->pushed.load(std::memory_order_relaxed);
+
+    if( pushed - _queue->popped.load(std::memory_order_acquire) >= (uint64_t)_queue->capacity ){
+        _queue->dropped.store(_queue->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    char * slot = _queue->slots.get() + (size_t)(pushed % _queue->capacity) * _queue->slot_bytes;
+
+    ProducerQueue::SlotHeader header;
+    header.var = idx;
+    header.tick = _logger->_tick->load(std::memory_order_relaxed);
+    memcpy(slot, &header, sizeof(header));
+
+    return slot + sizeof(header);
+}
+
+void MatLogger::Producer::commit()
+{
+    uint64_t pushed = _queue->pushed.load(std::memory_order_relaxed) + 1;
+
+    _queue->pushed.store(pushed, std::memory_order_release);
+
+    uint64_t depth = pushed - _queue->popped.load(std::memory_order_relaxed);
+
+    if( depth > _queue->high_water.load(std::memory_order_relaxed) ){
+        _queue->high_water.store(depth, std::memory_order_relaxed);
+    }
+}
+
+uint64_t MatLogger::Producer::getDroppedSamples() const
+{
+    return _queue ? _queue->dropped.load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t MatLogger::Producer::getHighWaterMark() const
+{
+    return _queue ? _queue->high_water.load(std::memory_order_relaxed) : 0;
+}
+
+void MatLogger::consumer_loop()
+{
+    block_signals();
+
+    while( _consumer_run ){
+
+        consume();
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+bool MatLogger::consume()
+{
+    std::lock_guard<std::mutex> guard(_vars_mutex);
+
+    bool pending = false;
+
+    for( auto& queue : _producers ){
+
+        uint64_t popped = queue->popped.load(std::memory_order_relaxed);
+        uint64_t pushed = queue->pushed.load(std::memory_order_acquire);
+
+        for( ; popped < pushed; popped++ ){
+
+            const char * slot = queue->slots.get() + (size_t)(popped % queue->capacity) * queue->slot_bytes;
+
+            ProducerQueue::SlotHeader header;
+            memcpy(&header, slot, sizeof(header));
+
+            VariableInfo& varinfo = _vars[header.var];
+
+            // with the Block policy, samples wait inside the queue until the streaming writer frees some space
+            if( _streaming && _stream_opts.overflow_policy == OverflowPolicy::Block && _stream_run &&
+                varinfo.stream->written.load(std::memory_order_relaxed) -
+                varinfo.stream->drained.load(std::memory_order_acquire) >= (uint64_t)varinfo.buffer_capacity ){
+                pending = true;
+                break;
+            }
+
+            if( !varinfo.aggregations.empty() ){
+                aggregate_stored(varinfo, slot + sizeof(header), header.tick);
+                continue;
+            }
+
+            if( varinfo.compressed ){
+                add_compressed(varinfo, Eigen::Map<const Eigen::MatrixXd>((const double *)(slot + sizeof(header)), varinfo.rows, varinfo.cols), header.tick);
+                continue;
+            }
+
+            int idx = reserve_slot(varinfo);
+
+            if( idx >= 0 ){
+                memcpy(varinfo.data.get() + (size_t)idx * varinfo.sample_bytes, slot + sizeof(header), varinfo.sample_bytes);
+                commit_slot(varinfo, idx, header.tick);
+            }
+        }
+
+        queue->popped.store(popped, std::memory_order_release);
+    }
+
+    return pending;
+}
+
+void MatLogger::stop_consumer()
+{
+    _consumer_run = false;
+
+    if( _consumer_thread.joinable() ){
+        _consumer_thread.join();
+    }
+
+    // move the samples which are still queued to the variables
+    while( consume() ){
+        std::this_thread::yield();
+    }
+}
+
+void MatLogger::stream_loop()
+{
+    block_signals();
+
+    while( _stream_run ){
+
+        {
+            std::lock_guard<std::mutex> guard(_vars_mutex);
+
+            for( VariableInfo& varinfo : _vars ){
+                drain(varinfo, false);
+            }
+
+            // the segment is sealed by another thread, see rotate()
+            if( segment_due() && !rotate() ){
+                Logger::error() << "Unable to rotate " << _file_name << Logger::endl();
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(_stream_opts.period_ms));
+    }
+}
+
+void MatLogger::drain(VariableInfo& varinfo, bool drain_all)
+{
+    StreamState& stream = *varinfo.stream;
+
+    uint64_t dropped = stream.dropped.load(std::memory_order_relaxed);
+
+    if( dropped != stream.dropped_reported ){
+        Logger::warning() << "Streaming writer for " << _file_name << " is falling behind: " <<
+            dropped - stream.dropped_reported << " samples of variable " << varinfo.name << " dropped" << Logger::endl();
+        stream.dropped_reported = dropped;
+    }
+
+    uint64_t written = stream.written.load(std::memory_order_acquire);
+    uint64_t drained = stream.drained.load(std::memory_order_relaxed);
+    uint64_t available = written - drained;
+    uint64_t chunk = std::max(varinfo.buffer_capacity / _stream_opts.chunks_per_buffer, 1);
+
+    if( available == 0 || (!drain_all && available < chunk) ){
+        return;
+    }
+
+    // the filled part of the ring is made of at most two contiguous segments
+    const size_t sample_bytes = varinfo.sample_bytes;
+    const char * data = varinfo.data.get();
+    uint64_t begin = drained % varinfo.buffer_capacity;
+    uint64_t first = std::min<uint64_t>(available, varinfo.buffer_capacity - begin);
+    uint64_t spooled = stream.spooled;
+
+    if( append(varinfo, data + begin*sample_bytes, first) && available > first ){
+        append(varinfo, data, available - first);
+    }
+
+    if( stream.spooled - spooled != available ){
+        Logger::error() << "Unable to write data of variable " << varinfo.name << " to disk" << Logger::endl();
+        stream.dropped.fetch_add(available - (stream.spooled - spooled), std::memory_order_relaxed);
+    }
+
+    // timestamps of the samples which have been moved to disk
+    if( varinfo.ticks && stream.spooled > spooled ){
+
+        std::vector<double> times(stream.spooled - spooled);
+        get_times(varinfo, begin, times.size(), times.data());
+
+        if( !append_time(varinfo, times.data(), times.size()) ){
+            Logger::error() << "Unable to write timestamps of variable " << varinfo.name << " to disk" << Logger::endl();
+        }
+    }
+
+    stream.drained.store(written, std::memory_order_release);
+
+    _segment_bytes += (stream.spooled - spooled) * sample_bytes;
+}
+
+bool MatLogger::append(VariableInfo& varinfo, const char * data, uint64_t n_samples)
+{
+    StreamState& stream = *varinfo.stream;
+
+    // MAT v7.3: samples are appended to a chunked HDF5 dataset along the time dimension
+    if( _file_format == FileFormat::MAT73 ){
+
+        if( !_stream_mat ){
+            return false;
+        }
+
+        std::vector<MatVariable> vars;
+        std::vector<std::unique_ptr<char[]>> buffers;
+
+        if( !varinfo.fields.empty() ){
+            describe_record(varinfo, n_samples, data, vars, buffers);
+        }
+        else{
+            vars.push_back(describe(varinfo, n_samples, data));
+        }
+
+        for( const MatVariable& var : vars ){
+
+            matvar_t * mat_var = create_mat_var(var);
+
+            int ret = Mat_VarWriteAppend(_stream_mat, mat_var, to_matio_compression(var.compression), var.rank);
+            Mat_VarFree(mat_var);
+
+            if( ret != 0 ){
+                return false;
+            }
+        }
+
+        stream.spooled += n_samples;
+        return true;
+    }
+
+    // MAT v5: samples are appended to a raw spool file which is packed at flush time
+    const size_t sample_bytes = varinfo.sample_bytes;
+
+    // spool files of rotated segments may still be waiting to be sealed
+    if( stream.spool_file.empty() ){
+        stream.spool_file = _stream_dir + "/" + std::to_string(_var_idx_map.at(varinfo.name)) +
+            "_" + std::to_string(_segment) + ".bin";
+    }
+
+    if( !spool(stream.fd, stream.spool_file, data, n_samples*sample_bytes, stream.spooled*sample_bytes) ){
+        return false;
+    }
+
+    stream.spooled += n_samples;
+    return true;
+}
+
+bool MatLogger::append_time(VariableInfo& varinfo, const double * times, uint64_t n_samples)
+{
+    StreamState& stream = *varinfo.stream;
+
+    if( _file_format == FileFormat::MAT73 ){
+
+        if( !_stream_mat ){
+            return false;
+        }
+
+        std::vector<MatVariable> vars;
+        describe_time(varinfo, n_samples, times, vars);
+
+        for( const MatVariable& var : vars ){
+
+            matvar_t * mat_var = create_mat_var(var);
+
+            int ret = Mat_VarWriteAppend(_stream_mat, mat_var, to_matio_compression(var.compression), var.rank);
+            Mat_VarFree(mat_var);
+
+            if( ret != 0 ){
+                return false;
+            }
+        }
+    }
+    else{
+
+        if( stream.time_file.empty() ){
+            stream.time_file = _stream_dir + "/" + std::to_string(_var_idx_map.at(varinfo.name)) +
+                "_" + std::to_string(_segment) + "_time.bin";
+        }
+
+        if( !spool(stream.time_fd, stream.time_file, (const char *)times,
+                   n_samples*sizeof(double), stream.time_spooled*sizeof(double)) ){
+            return false;
+        }
+    }
+
+    stream.time_spooled += n_samples;
+    return true;
+}
+
+bool MatLogger::spool(int& fd, const std::string& file, const char * data, std::size_t bytes, std::size_t spooled_bytes)
+{
+    if( fd < 0 ){
+        fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if( fd < 0 ){
+            Logger::error() << "Unable to open " << file << ": " << strerror(errno) << Logger::endl();
+            return false;
+        }
+    }
+
+    if( !write_all(fd, data, bytes) ){
+        // discard any partial write, so that the spool file only contains whole samples
+        if( ftruncate(fd, spooled_bytes) == 0 ){
+            lseek(fd, 0, SEEK_END);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+int MatLogger::get_dims(VariableType type, int rows, int cols, uint64_t n_samples, std::size_t * dims)
+{
+    if( type == VariableType::Matrix ){
+        dims[0] = rows;
+        dims[1] = cols;
+        dims[2] = n_samples;
+        return 3;
+    }
+    else{
+        dims[0] = rows;
+        dims[1] = n_samples;
+        return 2;
+    }
+}
+
+MatLogger::MatVariable MatLogger::describe(const VariableInfo& varinfo, uint64_t n_samples, const void * data) const
+{
+    MatVariable var;
+
+    var.compression = varinfo.compression_override ? varinfo.compression : _compression;
+    var.name = varinfo.name;
+    var.class_type = varinfo.class_type;
+    var.data_type = varinfo.data_type;
+    var.logical = varinfo.logical;
+    var.rank = get_dims(varinfo.type, varinfo.rows, varinfo.cols, n_samples, var.dims);
+    var.data = data;
+    var.bytes = n_samples * varinfo.sample_bytes;
+
+    return var;
+}
+
+void MatLogger::describe_record(const VariableInfo& varinfo,
+                                uint64_t n_samples,
+                                const char * data,
+                                std::vector<MatVariable>& vars,
+                                std::vector<std::unique_ptr<char[]>>& buffers) const
+{
+    // samples are stored row-wise, each field is gathered into its own contiguous buffer
+    for( const FieldInfo& field : varinfo.fields ){
+
+        MatVariable var;
+
+        var.compression = varinfo.compression_override ? varinfo.compression : _compression;
+        var.name = field.name;
+        var.class_type = field.class_type;
+        var.data_type = field.data_type;
+        var.logical = field.logical;
+        var.rank = get_dims(field.type, field.rows, field.cols, n_samples, var.dims);
+        var.bytes = n_samples * field.bytes;
+        var.data = nullptr;
+
+        if( n_samples > 0 ){
+
+            buffers.emplace_back(new char[var.bytes]);
+
+            char * dst = buffers.back().get();
+            const char * src = data + field.offset;
+
+            for( uint64_t i = 0; i < n_samples; i++ ){
+                memcpy(dst, src, field.bytes);
+                dst += field.bytes;
+                src += varinfo.sample_bytes;
+            }
+
+            var.data = buffers.back().get();
+        }
+
+        vars.push_back(var);
+    }
+}
+
+void MatLogger::describe_time(const VariableInfo& varinfo,
+                              uint64_t n_samples,
+                              const double * times,
+                              std::vector<MatVariable>& vars) const
+{
+    MatVariable var;
+
+    var.compression = varinfo.compression_override ? varinfo.compression : _compression;
+    var.class_type = MAT_C_DOUBLE;
+    var.data_type = MAT_T_DOUBLE;
+    var.logical = false;
+    var.rank = get_dims(VariableType::Scalar, 1, 1, n_samples, var.dims);
+    var.data = n_samples > 0 ? times : nullptr;
+    var.bytes = n_samples * sizeof(double);
+
+    // every field of a record gets its own (shared) time vector
+    if( varinfo.type == VariableType::Record ){
+        for( const FieldInfo& field : varinfo.fields ){
+            var.name = field.name + "_time";
+            vars.push_back(var);
+        }
+    }
+    else{
+        var.name = varinfo.name + "_time";
+        vars.push_back(var);
+    }
+}
+
+bool MatLogger::describe_spool(const VariableInfo& varinfo,
+                               std::vector<MatVariable>& vars,
+                               std::vector<std::unique_ptr<char[]>>& buffers,
+                               std::vector<std::pair<void *, std::size_t>>& mappings) const
+{
+    const StreamState& stream = *varinfo.stream;
+
+    void * data = map_file(stream.spool_file, stream.spooled * varinfo.sample_bytes);
+
+    if( data == MAP_FAILED ){
+        Logger::error() << "Unable to read back data of variable " << varinfo.name << Logger::endl();
+        return false;
+    }
+
+    if( !varinfo.fields.empty() ){
+        describe_record(varinfo, stream.spooled, (const char *)data, vars, buffers);
+    }
+    else{
+        vars.push_back(describe(varinfo, stream.spooled, data));
+    }
+
+    if( data ){
+        mappings.emplace_back(data, stream.spooled * varinfo.sample_bytes);
+    }
+
+    if( varinfo.ticks ){
+
+        void * times = map_file(stream.time_file, stream.time_spooled * sizeof(double));
+
+        if( times == MAP_FAILED ){
+            Logger::error() << "Unable to read back timestamps of variable " << varinfo.name << Logger::endl();
+            return false;
+        }
+
+        describe_time(varinfo, stream.time_spooled, (const double *)times, vars);
+
+        if( times ){
+            mappings.emplace_back(times, stream.time_spooled * sizeof(double));
+        }
+    }
+
+    return true;
+}
+
+matvar_t * MatLogger::create_mat_var(const MatVariable& var)
+{
+    std::size_t dims[3] = { var.dims[0], var.dims[1], var.dims[2] };
+    static double dummy = 0;
+
+    return Mat_VarCreate(var.name.c_str(),
+                         var.class_type,
+                         var.data_type,
+                         var.rank,
+                         dims,
+                         var.data ? (void *)var.data : &dummy,
+                         MAT_F_DONT_COPY_DATA | (var.logical ? MAT_F_LOGICAL : 0) );
+}
+
+void MatLogger::stop_stream()
+{
+    _stream_run = false;
+
+    if( _stream_thread.joinable() ){
+        _stream_thread.join();
+    }
+
+    for( VariableInfo& varinfo : _vars ){
+
+        drain(varinfo, true);
+
+        StreamState& stream = *varinfo.stream;
+
+        if( stream.dropped_reported > 0 ){
+            Logger::warning() << "Variable " << varinfo.name << ": " << stream.dropped_reported <<
+                " samples dropped because of buffer overflow" << Logger::endl();
+        }
+
+        close_spool(varinfo);
+    }
+
+    // the last segment is sealed by dump(), after the previous ones
+    stop_sealing();
+}
+
+void MatLogger::close_spool(VariableInfo& varinfo)
+{
+    StreamState& stream = *varinfo.stream;
+
+    if( stream.fd >= 0 ){
+        ::close(stream.fd);
+        stream.fd = -1;
+    }
+
+    if( stream.time_fd >= 0 ){
+        ::close(stream.time_fd);
+        stream.time_fd = -1;
+    }
+}
+
+bool MatLogger::segment_due() const
+{
+    if( _segment == 0 ){
+        return false;
+    }
+
+    if( _stream_opts.segment_bytes > 0 && _segment_bytes >= _stream_opts.segment_bytes ){
+        return true;
+    }
+
+    return _stream_opts.segment_seconds > 0 &&
+           std::chrono::steady_clock::now() - _segment_start >= std::chrono::seconds(_stream_opts.segment_seconds);
+}
+
+bool MatLogger::rotate()
+{
+    std::unique_ptr<Segment> segment(new Segment);
+    segment->file = segment_file();
+    segment->mat = _stream_mat;
+
+    // everything which has been logged so far belongs to the current segment: the
+    // segment takes over the spool files, and the variables start new ones
+    for( VariableInfo& varinfo : _vars ){
+
+        drain(varinfo, true);
+        close_spool(varinfo);
+
+        segment->vars.emplace_back();
+
+        VariableInfo& sealed = segment->vars.back();
+        sealed.name = varinfo.name;
+        sealed.type = varinfo.type;
+        sealed.class_type = varinfo.class_type;
+        sealed.data_type = varinfo.data_type;
+        sealed.logical = varinfo.logical;
+        sealed.rows = varinfo.rows;
+        sealed.cols = varinfo.cols;
+        sealed.sample_bytes = varinfo.sample_bytes;
+        sealed.fields = varinfo.fields;
+        sealed.ticks = varinfo.ticks;   // only tells whether timestamps are written
+        sealed.compression = varinfo.compression_override ? varinfo.compression : _compression;
+        sealed.compression_override = true;
+
+        StreamState& stream = *varinfo.stream;
+
+        sealed.stream.reset(new StreamState);
+        sealed.stream->spooled = stream.spooled;
+        sealed.stream->spool_file = stream.spool_file;
+        sealed.stream->time_spooled = stream.time_spooled;
+        sealed.stream->time_file = stream.time_file;
+
+        stream.spooled = 0;
+        stream.spool_file.clear();
+        stream.time_spooled = 0;
+        stream.time_file.clear();
+    }
+
+    _segment++;
+    _segment_bytes = 0;
+    _segment_start = std::chrono::steady_clock::now();
+
+    if( _file_format == FileFormat::MAT5 ){
+
+        {
+            std::lock_guard<std::mutex> guard(_seal_mutex);
+            _seal_queue.push_back(std::move(segment));
+        }
+
+        _seal_cond.notify_one();
+
+        return true;
+    }
+
+    // HDF5 is not thread safe: MAT v7.3 segments, whose samples are already
+    // inside the file, are closed here
+    bool ok = seal(*segment);
+
+    _stream_mat = Mat_CreateVer(segment_file().c_str(), nullptr, MAT_FT_MAT73);
+
+    if( !_stream_mat ){
+        Logger::error() << "Unable to create MAT file " << segment_file() << Logger::endl();
+        return false;
+    }
+
+    return ok;
+}
+
+void MatLogger::seal_loop()
+{
+    block_signals();
+
+    std::unique_lock<std::mutex> lock(_seal_mutex);
+
+    while( true ){
+
+        _seal_cond.wait(lock, [this](){ return !_seal_queue.empty() || !_seal_run; });
+
+        // pending segments are sealed before stopping
+        if( _seal_queue.empty() ){
+            return;
+        }
+
+        std::unique_ptr<Segment> segment = std::move(_seal_queue.front());
+        _seal_queue.pop_front();
+
+        lock.unlock();
+
+        if( !seal(*segment) ){
+            Logger::error() << "Unable to seal segment " << segment->file << Logger::endl();
+        }
+
+        lock.lock();
+    }
+}
+
+bool MatLogger::seal(Segment& segment)
+{
+    Logger::info(Logger::Severity::HIGH) << "Dumping data to mat file " << segment.file << Logger::endl();
+
+    std::vector<MatVariable> vars;
+    std::vector<std::pair<void *, std::size_t>> mappings;
+    std::vector<std::unique_ptr<char[]>> buffers;
+
+    for( const VariableInfo& varinfo : segment.vars ){
+
+        // MAT v7.3: data are already inside the file, only empty variables are missing
+        if( _file_format == FileFormat::MAT73 && varinfo.stream->spooled > 0 ){
+            continue;
+        }
+
+        describe_spool(varinfo, vars, buffers, mappings);
+    }
+
+    bool ok = false;
+
+    if( _file_format == FileFormat::MAT5 ){
+        ok = write_mat5(vars, segment.file);
+    }
+    else if( segment.mat ){
+        ok = write_mat73(segment.mat, vars);
+        Mat_Close(segment.mat);
+    }
+
+    for( auto& mapping : mappings ){
+        munmap(mapping.first, mapping.second);
+    }
+
+    for( const VariableInfo& varinfo : segment.vars ){
+
+        if( !varinfo.stream->spool_file.empty() ){
+            unlink(varinfo.stream->spool_file.c_str());
+        }
+
+        if( !varinfo.stream->time_file.empty() ){
+            unlink(varinfo.stream->time_file.c_str());
+        }
+    }
+
+    if( ok ){
+        Logger::success() << "Flushing to " << segment.file << " complete!" << Logger::endl();
+    }
+
+    return ok;
+}
+
+void MatLogger::stop_sealing()
+{
+    {
+        std::lock_guard<std::mutex> guard(_seal_mutex);
+        _seal_run = false;
+    }
+
+    _seal_cond.notify_one();
+
+    if( _seal_thread.joinable() ){
+        _seal_thread.join();
+    }
+}
+
+std::string MatLogger::segment_file() const
+{
+    if( _segment == 0 ){
+        return _file_name;
+    }
+
+    const std::string ext = ".mat";
+    bool has_ext = _file_name.size() > ext.size() && _file_name.compare(_file_name.size() - ext.size(), ext.size(), ext) == 0;
+    std::string base = has_ext ? _file_name.substr(0, _file_name.size() - ext.size()) : _file_name;
+
+    return base + "__part" + std::to_string(_segment) + ext;
+}
+
+void * MatLogger::map_file(const std::string& file, std::size_t bytes)
+{
+    if( bytes == 0 ){
+        return nullptr;
+    }
+
+    // spooled samples are mapped in memory, so that they are never loaded in RAM as a whole
+    int fd = ::open(file.c_str(), O_RDONLY);
+
+    if( fd < 0 ){
+        return MAP_FAILED;
+    }
+
+    void * data = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    return data;
+}
+
+bool MatLogger::mat5_header(const MatVariable& var, std::vector<char>& header)
+{
+    // uncompressed miMATRIX element: tag, array flags, dimensions, name, real part
+    auto put = [&header](uint32_t value){
+        header.insert(header.end(), (const char *)&value, (const char *)&value + 4);
+    };
+
+    uint32_t name_bytes = var.name.size();
+
+    header.clear();
+
+    put(MAT_T_MATRIX);
+    put(0); // size, filled below
+
+    put(MAT_T_UINT32);
+    put(8);
+    put(var.class_type | (var.logical ? MAT_F_LOGICAL : 0));
+    put(0);
+
+    put(MAT_T_INT32);
+    put(4*var.rank);
+    for( int i = 0; i < var.rank; i++ ){
+        put(var.dims[i]);
+    }
+    header.resize(header.size() + mat5_padding(4*var.rank), 0);
+
+    put(MAT_T_INT8);
+    put(name_bytes);
+    header.insert(header.end(), var.name.begin(), var.name.end());
+    header.resize(header.size() + mat5_padding(name_bytes), 0);
+
+    put(var.data_type);
+    put(var.bytes);
+
+    std::size_t matrix_bytes = header.size() - 8 + var.bytes + mat5_padding(var.bytes);
+
+    if( matrix_bytes > 0x7FFFFFFF ){
+        return false;
+    }
+
+    *(uint32_t *)&header[4] = matrix_bytes;
+
+    return true;
+}
+
+bool MatLogger::compress_mat5(const MatVariable& var,
+                              const std::vector<char>& header,
+                              std::unique_ptr<char[]>& element,
+                              std::size_t& element_bytes)
+{
+    int level = Z_DEFAULT_COMPRESSION;
+
+    if( var.compression == Compression::Fast ){
+        level = Z_BEST_SPEED;
+    }
+    else if( var.compression == Compression::Best ){
+        level = Z_BEST_COMPRESSION;
+    }
+
+    // compressed element: miCOMPRESSED tag followed by the zlib stream of the miMATRIX element
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    if( deflateInit(&zs, level) != Z_OK ){
+        return false;
+    }
+
+    std::size_t capacity = 8 + deflateBound(&zs, header.size() + var.bytes + mat5_padding(var.bytes));
+    element.reset(new char[capacity]);
+
+    zs.next_out = (Bytef *)element.get() + 8;
+    zs.avail_out = capacity - 8;
+
+    struct { const char * data; std::size_t bytes; } input[3] = {
+        { header.data(), header.size() },
+        { (const char *)var.data, var.bytes },
+        { mat5_zeros, mat5_padding(var.bytes) }
+    };
+
+    // the output buffer is large enough for the whole stream (see deflateBound)
+    int ret = Z_OK;
+
+    for( int i = 0; i < 3; i++ ){
+        zs.next_in = (Bytef *)input[i].data;
+        zs.avail_in = input[i].bytes;
+        ret = deflate(&zs, i == 2 ? Z_FINISH : Z_NO_FLUSH);
+    }
+
+    deflateEnd(&zs);
+
+    if( ret != Z_STREAM_END ){
+        return false;
+    }
+
+    element_bytes = 8 + zs.total_out;
+    ((uint32_t *)element.get())[0] = MAT_T_COMPRESSED;
+    ((uint32_t *)element.get())[1] = zs.total_out;
+
+    return true;
+}
+
+bool MatLogger::write_mat5(const std::vector<MatVariable>& vars, const std::string& file_name)
+{
+    // file header is written by matio, variables are then appended to it
+    mat_t * mat_file = Mat_CreateVer(file_name.c_str(), nullptr, MAT_FT_MAT5);
+
+    if( !mat_file ){
+        Logger::error() << "Unable to create MAT file " << file_name << Logger::endl();
+        return false;
+    }
+
+    Mat_Close(mat_file);
+
+    int fd = ::open(file_name.c_str(), O_WRONLY | O_APPEND);
+
+    if( fd < 0 ){
+        Logger::error() << "Unable to open MAT file " << file_name << ": " << strerror(errno) << Logger::endl();
+        return false;
+    }
+
+    for( const MatVariable& var : vars ){
+        Logger::info() << "Writing variable " << var.name << " to mat file..." << Logger::endl();
+    }
+
+    // variables are compressed concurrently, only file writes are serialized
+    std::atomic<unsigned int> next_var(0);
+    std::vector<char> success(vars.size(), 0);
+    std::mutex write_mutex;
+
+    // published at the end, getFlushStats() might be called while a segment is sealed
+    std::vector<VariableStats> flush_stats(vars.size());
+
+    auto worker = [&]()
+    {
+        unsigned int i;
+        std::vector<char> header;
+        std::unique_ptr<char[]> element;
+        std::size_t element_bytes = 0;
+
+        while( (i = next_var++) < vars.size() ){
+
+            const MatVariable& var = vars[i];
+            VariableStats& stats = flush_stats[i];
+            auto tic = std::chrono::steady_clock::now();
+
+            stats.name = var.name;
+            stats.compression = var.compression;
+
+            if( !mat5_header(var, header) ){
+                continue;
+            }
+
+            stats.raw_bytes = header.size() + var.bytes + mat5_padding(var.bytes);
+
+            if( var.compression == Compression::None ){
+                std::lock_guard<std::mutex> guard(write_mutex);
+                success[i] = write_all(fd, header.data(), header.size()) &&
+                             write_all(fd, (const char *)var.data, var.bytes) &&
+                             write_all(fd, mat5_zeros, mat5_padding(var.bytes));
+                stats.file_bytes = stats.raw_bytes;
+                stats.file_bytes_known = true;
+            }
+            else if( compress_mat5(var, header, element, element_bytes) ){
+                std::lock_guard<std::mutex> guard(write_mutex);
+                success[i] = write_all(fd, element.get(), element_bytes);
+                stats.file_bytes = element_bytes;
+                stats.file_bytes_known = true;
+            }
+
+            element.reset();
+
+            stats.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - tic).count();
+        }
+    };
+
+    unsigned int n_threads = _flush_threads > 0 ? _flush_threads : std::thread::hardware_concurrency();
+    n_threads = std::max(1u, std::min<unsigned int>(n_threads, vars.size()));
+
+    auto tic = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for( unsigned int i = 1; i < n_threads; i++ ){
+        workers.emplace_back(worker);
+    }
+
+    worker();
+
+    for( std::thread& t : workers ){
+        t.join();
+    }
+
+    double wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - tic).count();
+
+    ::close(fd);
+
+    bool ok = true;
+    double busy_time = 0;
+
+    for( unsigned int i = 0; i < vars.size(); i++ ){
+
+        const VariableStats& stats = flush_stats[i];
+
+        if( !success[i] ){
+            Logger::error() << "Unable to write variable " << vars[i].name << " to mat file " <<
+                "(MAT5 variables are limited to 2 GB, consider FileFormat::MAT73)" << Logger::endl();
+            ok = false;
+            continue;
+        }
+
+        Logger::info() << "Variable " << stats.name << ": " << stats.raw_bytes << " -> " << stats.file_bytes <<
+            " bytes (ratio " << (double)stats.raw_bytes / stats.file_bytes << ") in " << stats.time << " s" << Logger::endl();
+
+        busy_time += stats.time;
+    }
+
+    Logger::info() << "Compressed " << vars.size() << " variables on " << n_threads << " threads in " <<
+        wall_time << " s (speedup " << (wall_time > 0 ? busy_time/wall_time : 1.0) << "x)" << Logger::endl();
+
+    publish_flush_stats(flush_stats);
+
+    return ok;
+}
+
+bool MatLogger::write_mat73(mat_t * mat_file, const std::vector<MatVariable>& vars)
+{
+    bool ok = true;
+
+    std::vector<VariableStats> flush_stats(vars.size());
+
+    for( unsigned int i = 0; i < vars.size(); i++ ){
+
+        const MatVariable& var = vars[i];
+        VariableStats& stats = flush_stats[i];
+        auto tic = std::chrono::steady_clock::now();
+
+        Logger::info() << "Writing variable " << var.name << " to mat file..." << Logger::endl();
+
+        matvar_t * mat_var = create_mat_var(var);
+        ok = Mat_VarWrite(mat_file, mat_var, to_matio_compression(var.compression)) == 0 && ok;
+        Mat_VarFree(mat_var);
+
+        stats.name = var.name;
+        stats.compression = var.compression;
+        stats.raw_bytes = var.bytes;
+        stats.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - tic).count();
+
+        Logger::info() << "Variable " << stats.name << ": " << stats.raw_bytes << " bytes in " << stats.time <<
+            " s (size inside the file not available for MAT73)" << Logger::endl();
+    }
+
+    publish_flush_stats(flush_stats);
+
+    return ok;
+}
+
+void MatLogger::publish_flush_stats(std::vector<VariableStats>& flush_stats)
+{
+    std::lock_guard<std::mutex> guard(_flush_stats_mutex);
+    _flush_stats.swap(flush_stats);
+}
+
+enum matio_compression MatLogger::to_matio_compression(Compression compression)
+{
+    return compression == Compression::None ? MAT_COMPRESSION_NONE : MAT_COMPRESSION_ZLIB;
+}
+
+void MatLogger::flush()
+{
+    if( _flushed.exchange(true) ){
+        return;
+    }
+
+    stop_consumer();
+
+    if( _streaming ){
+        stop_stream();
+    }
+
+    dump();
+}
+
+bool MatLogger::dump()
+{
+    const std::string file_name = segment_file();
+
+    Logger::info(Logger::Severity::HIGH) << "Dumping data to mat file " << file_name << Logger::endl();
+
+    std::vector<MatVariable> vars;
+    std::vector<std::pair<void *, std::size_t>> mappings;
+    std::vector<std::unique_ptr<char[]>> buffers;
+    std::vector<std::unique_ptr<double[]>> time_buffers;
+
+    for( auto& pair : _single_var_map ){
+
+        MatVariable var;
+        var.name = pair.first;
+        var.class_type = MAT_C_DOUBLE;
+        var.data_type = MAT_T_DOUBLE;
+        var.logical = false;
+        var.rank = 2;
+        var.dims[0] = pair.second.rows();
+        var.dims[1] = pair.second.cols();
+        var.data = pair.second.data();
+        var.bytes = pair.second.size() * sizeof(double);
+        var.compression = _compression;
+
+        vars.push_back(var);
+    }
+
+    if( !_streaming ){
+
+        // see emergency_dump()
+        _rearranging = true;
+
+        while( _dumping ){
+            std::this_thread::yield();
+        }
+    }
+
+    for( VariableInfo& varinfo : _vars ){
+
+        // emergency flush: the thread interrupted by the signal left the buffer halfway through a write
+        if( handling_signal && varinfo.writing.load() ){
+            Logger::warning() << "Variable " << varinfo.name << " was being written when the signal arrived, skipping it" << Logger::endl();
+            continue;
+        }
+
+        if( varinfo.compressed ){
+
+            std::unique_ptr<char[]> data;
+            std::unique_ptr<uint32_t[]> ticks;
+
+            uint64_t n_samples = decode_compressed(varinfo, data, ticks);
+
+            vars.push_back(describe(varinfo, n_samples, data.get()));
+            buffers.push_back(std::move(data));
+
+            if( _time_track ){
+
+                time_buffers.emplace_back(new double[n_samples]);
+
+                for( uint64_t i = 0; i < n_samples; i++ ){
+                    time_buffers.back()[i] = tick_time(ticks[i]);
+                }
+
+                describe_time(varinfo, n_samples, time_buffers.back().get(), vars);
+            }
+
+            continue;
+        }
+
+        if( !_streaming ){
+
+            int n_samples = varinfo.rearrange();
+
+            // the ring file now starts at the oldest sample
+            if( varinfo.ring_written ){
+                varinfo.ring_written->store(n_samples);
+            }
+
+            if( !varinfo.fields.empty() ){
+                describe_record(varinfo, n_samples, varinfo.data.get(), vars, buffers);
+            }
+            else{
+                vars.push_back(describe(varinfo, n_samples, varinfo.data.get()));
+            }
+
+            if( varinfo.ticks ){
+                time_buffers.emplace_back(new double[n_samples]);
+                get_times(varinfo, 0, n_samples, time_buffers.back().get());
+                describe_time(varinfo, n_samples, time_buffers.back().get(), vars);
+            }
+
+            continue;
+        }
+
+        // MAT v7.3: data are already inside the file, only empty variables are missing
+        if( _file_format == FileFormat::MAT73 && varinfo.stream->spooled > 0 ){
+            continue;
+        }
+
+        describe_spool(varinfo, vars, buffers, mappings);
+    }
+
+    bool ok = false;
+
+    if( _file_format == FileFormat::MAT5 ){
+        ok = write_mat5(vars, file_name);
+    }
+    else{
+
+        mat_t * mat_file = _stream_mat ? _stream_mat : Mat_CreateVer(file_name.c_str(), nullptr, MAT_FT_MAT73);
+
+        if( mat_file ){
+            ok = write_mat73(mat_file, vars);
+            Mat_Close(mat_file);
+        }
+        else{
+            Logger::error() << "Unable to create MAT file " << file_name << Logger::endl();
+        }
+
+        _stream_mat = nullptr;
+    }
+
+    for( auto& mapping : mappings ){
+        munmap(mapping.first, mapping.second);
+    }
+
+    if( _streaming ){
+
+        for( VariableInfo& varinfo : _vars ){
+            if( !varinfo.stream->spool_file.empty() ){
+                unlink(varinfo.stream->spool_file.c_str());
+            }
+
+            if( !varinfo.stream->time_file.empty() ){
+                unlink(varinfo.stream->time_file.c_str());
+            }
+        }
+
+        if( !_stream_dir.empty() ){
+            rmdir(_stream_dir.c_str());
+        }
+    }
+
+    // data are safe inside the mat file
+    if( ok && !_ring_dir.empty() ){
+
+        for( unsigned int i = 0; i < _vars.size(); i++ ){
+            unlink(ring_file(i).c_str());
+        }
+
+        unlink((_ring_dir + "/time.ring").c_str());
+        rmdir(_ring_dir.c_str());
+    }
+
+    if( ok ){
+        Logger::success() << "Flushing to " << file_name << " complete!" << Logger::endl();
+    }
+
+    return ok;
+}
+
+void MatLogger::setCompression(Compression compression)
+{
+    _compression = compression;
+}
+
+bool MatLogger::setCompression(const std::string& name, Compression compression)
+{
+    auto it = _var_idx_map.find(name);
+
+    if( it == _var_idx_map.end() ){
+        return false;
+    }
+
+    _vars[it->second].compression = compression;
+    _vars[it->second].compression_override = true;
+
+    return true;
+}
+
+bool MatLogger::setDecimation(const std::string& name, int window, const std::vector<Aggregation>& modes)
+{
+    auto it = _var_idx_map.find(name);
+
+    if( it == _var_idx_map.end() || _vars[it->second].name != name ){
+        Logger::error() << "Variable " << name << " does not exist" << Logger::endl();
+        return false;
+    }
+
+    VariableInfo& varinfo = _vars[it->second];
+
+    if( varinfo.type == VariableType::Record || varinfo.interleave != 1 || !varinfo.aggregations.empty() || varinfo.compressed ){
+        Logger::error() << "Decimation is not available for variable " << name << " (record, interleave, decimation or compressed storage already set)" << Logger::endl();
+        return false;
+    }
+
+    if( window < 1 || modes.empty() ){
+        Logger::error() << "Invalid decimation for variable " << name << Logger::endl();
+        return false;
+    }
+
+    bool logged = _streaming ? varinfo.stream->written.load() > 0 : !varinfo.empty;
+
+    if( logged || !_producers.empty() || _flushed ){
+        Logger::error() << "Decimation must be set before logging variable " << name << " and before creating any producer" << Logger::endl();
+        return false;
+    }
+
+    const char * suffixes[] = {"_mean", "_min", "_max", "_rms"};
+    const int field_bytes = varinfo.sample_bytes;
+    std::vector<FieldInfo> fields;
+
+    for( Aggregation mode : modes ){
+
+        FieldInfo field;
+        field.name = name + suffixes[(int)mode];
+        field.type = varinfo.type;
+        field.class_type = varinfo.class_type;
+        field.data_type = varinfo.data_type;
+        field.logical = varinfo.logical;
+        field.rows = varinfo.rows;
+        field.cols = varinfo.cols;
+        field.offset = fields.size() * field_bytes;
+        field.bytes = field_bytes;
+
+        bool duplicate = std::count(modes.begin(), modes.end(), mode) > 1;
+
+        if( duplicate || _var_idx_map.count(field.name) || _single_var_map.count(field.name) ){
+            Logger::error() << "Variable name " << field.name << " is not available" << Logger::endl();
+            return false;
+        }
+
+        fields.push_back(field);
+    }
+
+    // the buffer is replaced by one with a slot per statistic, which is allocated
+    // first, so that the variable is left untouched if the allocation fails
+    VariableInfo resized;
+    resized.name = varinfo.name;
+    resized.interleave = varinfo.interleave;
+    resized.type = varinfo.type;
+    resized.class_type = varinfo.class_type;
+    resized.data_type = varinfo.data_type;
+    resized.logical = varinfo.logical;
+    resized.rows = varinfo.rows;
+    resized.cols = varinfo.cols;
+    resized.buffer_capacity = varinfo.buffer_capacity;
+    resized.sample_bytes = field_bytes * fields.size();
+    resized.fields = fields;
+
+    // the new ring file replaces the old one only once it has been created
+    const std::string ring = _ring_dir.empty() ? std::string() : ring_file(it->second) + ".new";
+
+    if( !allocate_storage(resized, ring) ){
+        return false;
+    }
+
+    if( !ring.empty() && rename(ring.c_str(), ring_file(it->second).c_str()) != 0 ){
+        Logger::error() << "Unable to replace the ring file of variable " << name << ": " << strerror(errno) << Logger::endl();
+        unlink(ring.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(_vars_mutex);
+
+    varinfo.data = resized.data;
+    varinfo.ticks = resized.ticks;
+    varinfo.ring_written = resized.ring_written;
+    varinfo.header = resized.header;
+    varinfo.sample_bytes = resized.sample_bytes;
+    varinfo.fields = fields;
+    varinfo.aggregations = modes;
+    varinfo.window = window;
+    varinfo.window_count = 0;
+    varinfo.acc_sum.setZero(varinfo.rows, varinfo.cols);
+    varinfo.acc_squares.setZero(varinfo.rows, varinfo.cols);
+    varinfo.acc_min.setZero(varinfo.rows, varinfo.cols);
+    varinfo.acc_max.setZero(varinfo.rows, varinfo.cols);
+
+    for( const FieldInfo& field : fields ){
+        _var_idx_map[field.name] = it->second;
+    }
+
+    return true;
+}
+
+void MatLogger::aggregate_stored(VariableInfo& varinfo, const char * data, uint32_t tick)
+{
+    switch( varinfo.class_type ){
+
+        case MAT_C_SINGLE:
+            aggregate(varinfo, Eigen::Map<const Eigen::MatrixXf>((const float *)data, varinfo.rows, varinfo.cols), tick);
+            break;
+
+        case MAT_C_INT32:
+            aggregate(varinfo, Eigen::Map<const Eigen::Matrix<int32_t, -1, -1>>((const int32_t *)data, varinfo.rows, varinfo.cols), tick);
+            break;
+
+        case MAT_C_INT16:
+            aggregate(varinfo, Eigen::Map<const Eigen::Matrix<int16_t, -1, -1>>((const int16_t *)data, varinfo.rows, varinfo.cols), tick);
+            break;
+
+        case MAT_C_UINT8:
+            aggregate(varinfo, Eigen::Map<const Eigen::Matrix<uint8_t, -1, -1>>((const uint8_t *)data, varinfo.rows, varinfo.cols), tick);
+            break;
+
+        default:
+            aggregate(varinfo, Eigen::Map<const Eigen::MatrixXd>((const double *)data, varinfo.rows, varinfo.cols), tick);
+
+    }
+}
+
+bool MatLogger::setCompressedStorage(const std::string& name, int block_bytes)
+{
+    auto it = _var_idx_map.find(name);
+
+    if( it == _var_idx_map.end() || _vars[it->second].name != name ){
+        Logger::error() << "Variable " << name << " does not exist" << Logger::endl();
+        return false;
+    }
+
+    VariableInfo& varinfo = _vars[it->second];
+
+    if( varinfo.class_type != MAT_C_DOUBLE || !varinfo.fields.empty() || varinfo.compressed ){
+        Logger::error() << "Compressed storage is not available for variable " << name << " (not stored as double, decimation or compressed storage already set)" << Logger::endl();
+        return false;
+    }
+
+    if( _streaming || !_ring_dir.empty() || _arena ){
+        Logger::error() << "Compressed storage is not available in streaming mode, with crash recovery and with a memory budget" << Logger::endl();
+        return false;
+    }
+
+    if( !varinfo.empty || !_producers.empty() || _flushed ){
+        Logger::error() << "Compressed storage must be enabled before logging variable " << name << " and before creating any producer" << Logger::endl();
+        return false;
+    }
+
+    int n_elements = varinfo.rows * varinfo.cols;
+
+    if( block_bytes <= 0 || 8u * (block_bytes - 4) < 2 * max_compressed_bits(n_elements) ){
+        Logger::error() << "Blocks of " << block_bytes << " bytes are too small for variable " << name << Logger::endl();
+        return false;
+    }
+
+    // the memory of the plain buffer (and of its timestamps) is kept
+    std::size_t bytes = (std::size_t)varinfo.buffer_capacity * (varinfo.sample_bytes + (varinfo.ticks ? sizeof(uint32_t) : 0));
+    int n_blocks = std::max<std::size_t>(bytes / block_bytes, 2);
+
+    std::shared_ptr<char> blocks = allocate_buffer((std::size_t)n_blocks * block_bytes);
+
+    if( !blocks ){
+        Logger::error() << "Unable to allocate the compressed buffer of variable " << name << Logger::endl();
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(_vars_mutex);
+
+    varinfo.data = blocks;
+    varinfo.ticks.reset();
+    varinfo.compressed.reset(new CompressedRing);
+    varinfo.compressed->block_bytes = block_bytes;
+    varinfo.compressed->n_blocks = n_blocks;
+    varinfo.compressed->prev.resize(n_elements);
+    varinfo.compressed->leading.resize(n_elements);
+    varinfo.compressed->trailing.resize(n_elements);
+
+    return true;
+}
+
+uint64_t MatLogger::decode_compressed(const VariableInfo& varinfo, std::unique_ptr<char[]>& data, std::unique_ptr<uint32_t[]>& ticks) const
+{
+    const CompressedRing& ring = *varinfo.compressed;
+    const int n_elements = varinfo.rows * varinfo.cols;
+    const bool has_ticks = (bool)_time_track;
+
+    uint64_t n_samples = 0;
+
+    for( int b = 0; b < ring.used_blocks; b++ ){
+        uint32_t block_samples;
+        memcpy(&block_samples, varinfo.data.get() + (size_t)((ring.first_block + b) % ring.n_blocks) * ring.block_bytes, sizeof(block_samples));
+        n_samples += block_samples;
+    }
+
+    data.reset(new char[std::max<uint64_t>(n_samples, 1) * varinfo.sample_bytes]);
+    ticks.reset(new uint32_t[std::max<uint64_t>(n_samples, 1)]);
+
+    double * dst = (double *)data.get();
+    uint32_t * tick_dst = ticks.get();
+
+    std::vector<uint64_t> prev(n_elements);
+    std::vector<int> leading(n_elements), trailing(n_elements);
+
+    for( int b = 0; b < ring.used_blocks; b++ ){
+
+        const char * block_data = varinfo.data.get() + (size_t)((ring.first_block + b) % ring.n_blocks) * ring.block_bytes;
+        const uint8_t * block = (const uint8_t *)block_data;
+
+        uint32_t block_samples;
+        memcpy(&block_samples, block_data, sizeof(block_samples));
+
+        uint32_t pos = 32;
+        uint32_t tick = 0;
+
+        for( uint32_t k = 0; k < block_samples; k++ ){
+
+            if( has_ticks ){
+                if( k == 0 ){
+                    tick = get_bits(block, pos, 32);
+                }
+                else if( get_bits(block, pos, 1) == 0 ){
+                    tick++;
+                }
+                else if( get_bits(block, pos, 1) == 1 ){
+                    tick = get_bits(block, pos, 32);
+                }
+            }
+
+            *tick_dst++ = tick;
+
+            for( int i = 0; i < n_elements; i++ ){
+
+                if( k == 0 ){
+                    prev[i] = get_bits(block, pos, 64);
+                }
+                else if( get_bits(block, pos, 1) == 1 ){
+
+                    if( get_bits(block, pos, 1) == 1 ){
+                        leading[i] = get_bits(block, pos, 5);
+                        int n_bits = get_bits(block, pos, 6) + 1;
+                        trailing[i] = 64 - leading[i] - n_bits;
+                    }
+
+                    prev[i] ^= get_bits(block, pos, 64 - leading[i] - trailing[i]) << trailing[i];
+                }
+
+                memcpy(dst++, &prev[i], sizeof(double));
+            }
+        }
+    }
+
+    return n_samples;
+}
+
+std::vector<MatLogger::VariableStats> MatLogger::getFlushStats() const
+{
+    std::lock_guard<std::mutex> guard(_flush_stats_mutex);
+    return _flush_stats;
+}
+
+bool MatLogger::setFlushThreads(int n_threads)
+{
+    if( n_threads < 0 ){
+        return false;
+    }
+
+    _flush_threads = n_threads;
+
+    return true;
+}
+
+MatLogger::~MatLogger()
+{
+    for( auto& slot : signal_loggers ){
+        MatLogger * logger = this;
+        slot.compare_exchange_strong(logger, nullptr);
+    }
+
+    _consumer_run = false;
+
+    if( _consumer_thread.joinable() ){
+        _consumer_thread.join();
+    }
+
+    _stream_run = false;
+
+    if( _stream_thread.joinable() ){
+        _stream_thread.join();
+    }
+
+    stop_sealing();
+
+    if( _stream_mat ){
+        Mat_Close(_stream_mat);
+    }
+}
+
+
+}
@@ -19,23 +19,394 @@
 #else
     #include <stdio.h>
     #define DPRINTF printf
+    #define RT_LOG_WRITE    // messages are written to stdout by write()
 #endif
 
 #endif
 
 
-// #define MT_SAFE
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <cstring>
+#include <cstddef>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
 
-#ifdef MT_SAFE
-#define SET_LOCK_GUARD(x) std::lock_guard<Mutex> guard(x);
+namespace {
+    
+    /**
+     * @brief Conversion specification of a printf format string.
+     */
+    struct FormatSpec {
+        enum Length { None, Char, Short, Long, LongLong, LongDouble, IntMax, Size, PtrDiff };
+        int stars;          // width and precision given as int arguments
+        Length length;
+        char conversion;
+    };
+    
+    /**
+     * @brief Parses the conversion specification which starts at p (the character after '%').
+     * 
+     * @return The end of the specification, or nullptr if it is not supported.
+     */
+    const char * parse_spec(const char * p, FormatSpec& spec)
+    {
+        spec.stars = 0;
+        spec.length = FormatSpec::None;
+        
+        while( *p && strchr("-+ #0'", *p) ){
+            p++;
+        }
+        
+        if( *p == '*' ){
+            spec.stars++;
+            p++;
+        }
+        
+        while( *p >= '0' && *p <= '9' ){
+            p++;
+        }
+        
+        if( *p == '.' ){
+            
+            p++;
+            
+            if( *p == '*' ){
+                spec.stars++;
+                p++;
+            }
+            
+            while( *p >= '0' && *p <= '9' ){
+                p++;
+            }
+        }
+        
+        switch( *p ){
+            case 'h': p++; spec.length = *p == 'h' ? (p++, FormatSpec::Char) : FormatSpec::Short; break;
+            case 'l': p++; spec.length = *p == 'l' ? (p++, FormatSpec::LongLong) : FormatSpec::Long; break;
+            case 'L': p++; spec.length = FormatSpec::LongDouble; break;
+            case 'j': p++; spec.length = FormatSpec::IntMax; break;
+            case 'z': p++; spec.length = FormatSpec::Size; break;
+            case 't': p++; spec.length = FormatSpec::PtrDiff; break;
+        }
+        
+        spec.conversion = *p;
+        
+        // %n writes through its argument, wide characters would need a conversion
+        if( !*p || !strchr("diouxXcCeEfFgGaAsSp%", *p) || *p == 'C' || *p == 'S' ||
+            (spec.length == FormatSpec::Long && (*p == 'c' || *p == 's')) ){
+            return nullptr;
+        }
+        
+        return p + 1;
+    }
+    
+    template <typename T>
+    bool put_arg(char * out, std::size_t size, std::size_t& used, T value)
+    {
+        if( used + sizeof(T) > size ){
+            return false;
+        }
+        
+        memcpy(out + used, &value, sizeof(T));
+        used += sizeof(T);
+        return true;
+    }
+    
+    template <typename T>
+    T get_arg(const char *& in)
+    {
+        T value;
+        memcpy(&value, in, sizeof(T));
+        in += sizeof(T);
+        return value;
+    }
+    
+    /**
+     * @brief Copies the arguments of a printf call into out, as raw bytes (strings
+     * are copied with their terminator).
+     * 
+     * @return False if the format is not supported or the arguments do not fit.
+     */
+    bool encode_args(const char * fmt, va_list args, char * out, std::size_t size, std::size_t& used)
+    {
+        for( const char * p = strchr(fmt, '%'); p; p = strchr(p, '%') ){
+            
+            FormatSpec spec;
+            const char * end = parse_spec(p + 1, spec);
+            
+            if( !end || end - p >= 32 ){
+                return false;
+            }
+            
+            p = end;
+            
+            for( int i = 0; i < spec.stars; i++ ){
+                if( !put_arg(out, size, used, va_arg(args, int)) ) return false;
+            }
+            
+            bool ok = true;
+            
+            switch( spec.conversion ){
+                
+                case '%':
+                    break;
+                    
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+                    switch( spec.length ){
+                        case FormatSpec::Long:     ok = put_arg(out, size, used, va_arg(args, long)); break;
+                        case FormatSpec::LongLong: ok = put_arg(out, size, used, va_arg(args, long long)); break;
+                        case FormatSpec::IntMax:   ok = put_arg(out, size, used, va_arg(args, intmax_t)); break;
+                        case FormatSpec::Size:     ok = put_arg(out, size, used, va_arg(args, size_t)); break;
+                        case FormatSpec::PtrDiff:  ok = put_arg(out, size, used, va_arg(args, ptrdiff_t)); break;
+                        default:                   ok = put_arg(out, size, used, va_arg(args, int)); break;
+                    }
+                    break;
+                    
+                case 'p':
+                    ok = put_arg(out, size, used, va_arg(args, void *));
+                    break;
+                    
+                case 's': {
+                    const char * str = va_arg(args, const char *);
+                    str = str ? str : "(null)";
+                    std::size_t len = strlen(str) + 1;
+                    ok = used + len <= size;
+                    if( ok ){
+                        memcpy(out + used, str, len);
+                        used += len;
+                    }
+                    break;
+                }
+                
+                default:
+                    if( spec.length == FormatSpec::LongDouble ){
+                        ok = put_arg(out, size, used, va_arg(args, long double));
+                    }
+                    else{
+                        ok = put_arg(out, size, used, va_arg(args, double));
+                    }
+                    break;
+            }
+            
+            if( !ok ){
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    template <typename T>
+    int print_arg(char * out, std::size_t size, const char * spec, const int * stars, int n_stars, T value)
+    {
+        switch( n_stars ){
+            case 0:  return snprintf(out, size, spec, value);
+            case 1:  return snprintf(out, size, spec, stars[0], value);
+            default: return snprintf(out, size, spec, stars[0], stars[1], value);
+        }
+    }
+    
+    /**
+     * @brief Renders a format string with the arguments stored by encode_args().
+     * 
+     * @return The number of characters written to out (excluding the terminator).
+     */
+    std::size_t render_args(const char * fmt, const char * in, char * out, std::size_t size)
+    {
+        std::size_t used = 0;
+        const char * p = fmt;
+        
+        while( *p && used + 1 < size ){
+            
+            const char * percent = strchr(p, '%');
+            std::size_t literal = percent ? percent - p : strlen(p);
+            
+            literal = std::min(literal, size - 1 - used);
+            memcpy(out + used, p, literal);
+            used += literal;
+            
+            if( !percent || used + 1 >= size ){
+                break;
+            }
+            
+            FormatSpec spec;
+            p = parse_spec(percent + 1, spec);
+            
+            char spec_str[32];
+            memcpy(spec_str, percent, p - percent);
+            spec_str[p - percent] = '\0';
+            
+            int stars[2];
+            
+            for( int i = 0; i < spec.stars; i++ ){
+                stars[i] = get_arg<int>(in);
+            }
+            
+            char * dst = out + used;
+            std::size_t left = size - used;
+            int ret = 0;
+            
+            switch( spec.conversion ){
+                
+                case '%':
+                    ret = print_arg(dst, left, "%s", stars, 0, "%");
+                    break;
+                    
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+                    switch( spec.length ){
+                        case FormatSpec::Long:     ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<long>(in)); break;
+                        case FormatSpec::LongLong: ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<long long>(in)); break;
+                        case FormatSpec::IntMax:   ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<intmax_t>(in)); break;
+                        case FormatSpec::Size:     ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<size_t>(in)); break;
+                        case FormatSpec::PtrDiff:  ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<ptrdiff_t>(in)); break;
+                        default:                   ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<int>(in)); break;
+                    }
+                    break;
+                    
+                case 'p':
+                    ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<void *>(in));
+                    break;
+                    
+                case 's':
+                    ret = print_arg(dst, left, spec_str, stars, spec.stars, in);
+                    in += strlen(in) + 1;
+                    break;
+                    
+                default:
+                    if( spec.length == FormatSpec::LongDouble ){
+                        ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<long double>(in));
+                    }
+                    else{
+                        ret = print_arg(dst, left, spec_str, stars, spec.stars, get_arg<double>(in));
+                    }
+                    break;
+            }
+            
+            used += std::min<std::size_t>(std::max(ret, 0), left - 1);
+        }
+        
+        out[used] = '\0';
+        return used;
+    }
+    
+    /**
+     * @brief Writes len bytes of console output (newlines included) by a single call.
+     */
+    void write_console(const char * data, std::size_t len)
+    {
+#ifdef RT_LOG_WRITE
+        // what the application has printed by stdio goes first
+        fflush(stdout);
+        
+        while( len > 0 ){
+            
+            ssize_t ret = write(STDOUT_FILENO, data, len);
+            
+            if( ret < 0 ){
+                if( errno == EINTR ){
+                    continue;
+                }
+                break;
+            }
+            
+            data += ret;
+            len -= ret;
+        }
 #else
-#define SET_LOCK_GUARD(x)
+        DPRINTF("%.*s", (int)len, data);
 #endif
-
-#include <pthread.h>
+    }
+    
+}
 
 namespace XBot {
     
+    /**
+     * @brief Bounded lock-free MPSC queue of fixed-size records, which a background
+     * thread writes to stdout. A message longer than a record is split over several
+     * consecutive records, which are claimed at once; records are published and
+     * released one by one through their sequence number.
+     * 
+     * With deferred formatting, printf-like messages are queued as a binary record
+     * (header, format string pointer and raw arguments, see encode_args()), which is
+     * only rendered by the background thread.
+     */
+    class AsyncSink {
+        
+    public:
+        
+        AsyncSink(int queue_size, Logger::OverflowPolicy policy, bool deferred_formatting);
+        
+        ~AsyncSink();
+        
+        /**
+         * @brief Queues a message, followed by a newline.
+         * 
+         * @return False if the message has been dropped.
+         */
+        bool push(const char * msg, std::size_t len);
+        
+        /**
+         * @brief Queues a printf-like message: the header is copied as it is, the
+         * arguments are copied as raw bytes and formatted by the background thread.
+         * 
+         * @return False if the message cannot be deferred, and must be formatted by
+         * the caller (a message which has been dropped is handled).
+         */
+        bool push_format(const char * header, std::size_t header_len, const char * fmt, va_list args);
+        
+        bool deferred() const { return _deferred; }
+        
+        uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+        
+        static const int RECORD_SIZE = 256;
+        static const int RECORD_BYTES = RECORD_SIZE - 12;
+        static const int MESSAGE_SIZE = 4096;
+        
+    private:
+        
+        static const int WRITE_BATCH = 256;
+        static const int TEXT_SIZE = 16*MESSAGE_SIZE;
+        
+        struct Record {
+            std::atomic<uint64_t> seq;
+            uint16_t len;
+            uint16_t span;      // records of a binary message (in its first record), 0 for text
+            char data[RECORD_BYTES];
+        };
+        
+        bool claim(uint64_t n, uint64_t& pos);
+        
+        void fill(uint64_t pos, uint64_t n, const char * data, std::size_t len, bool newline, bool binary);
+        
+        std::size_t render(uint64_t first, uint64_t n, char * out, std::size_t size) const;
+        
+        void run();
+        
+        int drain();
+        
+        std::unique_ptr<Record[]> _records;
+        uint64_t _capacity;
+        std::atomic<uint64_t> _head;
+        uint64_t _tail;
+        std::atomic<uint64_t> _dropped;
+        Logger::OverflowPolicy _policy;
+        bool _deferred;
+        std::unique_ptr<char[]> _text;      // messages rendered by the background thread
+        std::atomic<bool> _run;
+        std::thread _thread;
+        
+    };
+    
+    
     LoggerClass Logger::_logger("");
     
         
@@ -164,6 +535,31 @@ namespace XBot {
     {
         return _logger.getVerbosityLevel();
     }
+    
+    bool Logger::EnableAsync(int queue_size, Logger::OverflowPolicy policy, bool deferred_formatting)
+    {
+        return _logger.enableAsync(queue_size, policy, deferred_formatting);
+    }
+    
+    void Logger::DisableAsync()
+    {
+        _logger.disableAsync();
+    }
+    
+    uint64_t Logger::GetDroppedMessages()
+    {
+        return _logger.getDroppedMessages();
+    }
+    
+    void Logger::SetFlushPolicy(Logger::Severity flush_severity, int batch_bytes, int max_delay_ms)
+    {
+        _logger.setFlushPolicy(flush_severity, batch_bytes, max_delay_ms);
+    }
+    
+    void Logger::Flush()
+    {
+        _logger.flush();
+    }
 
     
     std::ostream& bold_on(std::ostream& os)
@@ -210,30 +606,200 @@ namespace XBot {
     LoggerClass::LoggerClass(std::string name):
         _endl(*this),
         _name(name),
-        _mutex(new XBot::Mutex(XBot::Mutex::Type::RECURSIVE))
+        _verbosity_level(Logger::Severity::LOW),
+        _flush_severity(Logger::Severity::DEBUG),
+        _batch_bytes(64*1024),
+        _max_delay_ms(100),
+        _flusher_run(false),
+        _async(nullptr),
+        _async_users(0),
+        _async_dropped(0)
     {
         if(_name != ""){
             _name_tag = " (" + name + ")";
         }
         
-        _sink.open(_buffer);
+        std::ostringstream header;
+        
+        header << bold_on << "[info" << _name_tag << "] " << bold_off;
+        _info_header = header.str();
+        
+        header.str("");
+        header << bold_on << color_red << "[error" << _name_tag << "] " << bold_off << color_red;
+        _error_header = header.str();
+        
+        header.str("");
+        header << bold_on << color_yellow << "[warning" << _name_tag << "] " << bold_off << color_yellow;
+        _warning_header = header.str();
+        
+        header.str("");
+        header << bold_on << color_green << "[success" << _name_tag << "] " << bold_off << color_green;
+        _success_header = header.str();
+        
+        pthread_key_create(&_message_key, &LoggerClass::delete_message);
     }
     
     XBot::LoggerClass::~LoggerClass()
     {
         
-        _sink.close();
+        disableAsync();
+        
+        stop_flusher();
+        
+        // the messages of threads which are still running are not released (a few KB each),
+        // but their pending batches are written
+        delete_message(pthread_getspecific(_message_key));
+        flush_pending(false);
+        pthread_key_delete(_message_key);
         
-        if((int)_verbosity_level <= (int)Logger::Severity::LOW){
+        if((int)_verbosity_level.load() <= (int)Logger::Severity::LOW){
             std::cout << __func__ << std::endl;
         }
     }
 
     
-    void LoggerClass::init_sink()
+    LoggerClass::Message::Message(LoggerClass * logger):
+        logger(logger),
+        severity(Logger::Severity::HIGH),
+        null_sink(nullptr),
+        suppressed(false),
+        pending(false)
     {
-        memset(_buffer, 0, BUFFER_SIZE);
-        _sink.seekp(0);
+        sink.open(boost::iostreams::array_sink(buffer, BUFFER_SIZE));
+    }
+    
+    LoggerClass::Message::~Message()
+    {
+        flush_batch();
+    }
+    
+    void LoggerClass::Message::flush_batch()
+    {
+        if( batch.empty() ){
+            return;
+        }
+        
+        write_console(batch.data(), batch.size());
+        batch.clear();
+        pending.store(false, std::memory_order_release);
+    }
+    
+    bool LoggerClass::Message::batch_expired(std::chrono::steady_clock::time_point now) const
+    {
+        return now - batch_start >= std::chrono::milliseconds(logger->_max_delay_ms.load(std::memory_order_relaxed));
+    }
+    
+    LoggerClass::Message& LoggerClass::message()
+    {
+        void * msg = pthread_getspecific(_message_key);
+        
+        // first message of this thread
+        if( !msg ){
+            msg = new Message(this);
+            pthread_setspecific(_message_key, msg);
+            
+            std::lock_guard<std::mutex> lock(_messages_mutex);
+            _messages.push_back(static_cast<Message *>(msg));
+        }
+        
+        return *static_cast<Message *>(msg);
+    }
+    
+    void LoggerClass::delete_message(void * message)
+    {
+        Message * msg = static_cast<Message *>(message);
+        
+        if( !msg ){
+            return;
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(msg->logger->_messages_mutex);
+            std::vector<Message *>& messages = msg->logger->_messages;
+            messages.erase(std::remove(messages.begin(), messages.end(), msg), messages.end());
+        }
+        
+        // no longer reachable by the flusher thread, the pending batch is written here
+        delete msg;
+    }
+    
+    void LoggerClass::flush_pending(bool expired_only)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        
+        std::lock_guard<std::mutex> lock(_messages_mutex);
+        
+        for( Message * msg : _messages ){
+            
+            if( !msg->pending.load(std::memory_order_acquire) ){
+                continue;
+            }
+            
+            std::lock_guard<std::mutex> batch_lock(msg->batch_mutex);
+            
+            if( !expired_only || msg->batch_expired(now) ){
+                msg->flush_batch();
+            }
+        }
+    }
+    
+    void LoggerClass::start_flusher()
+    {
+        std::lock_guard<std::mutex> lock(_flusher_mutex);
+        
+        if( _flusher_run ){
+            return;
+        }
+        
+        _flusher_run = true;
+        _flusher = std::thread(&LoggerClass::flusher_loop, this);
+    }
+    
+    void LoggerClass::stop_flusher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_flusher_mutex);
+            _flusher_run = false;
+        }
+        
+        _flusher_cond.notify_all();
+        
+        if( _flusher.joinable() ){
+            _flusher.join();
+        }
+    }
+    
+    void LoggerClass::flusher_loop()
+    {
+        // signals are for the threads which are logging
+        sigset_t set;
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        
+        std::unique_lock<std::mutex> lock(_flusher_mutex);
+        
+        while( _flusher_run ){
+            
+            // a pending message is written at most half a delay after it has expired
+            int period_ms = std::max(_max_delay_ms.load(std::memory_order_relaxed) / 2, 1);
+            
+            _flusher_cond.wait_for(lock, std::chrono::milliseconds(period_ms));
+            
+            if( !_flusher_run ){
+                break;
+            }
+            
+            lock.unlock();
+            flush_pending(true);
+            lock.lock();
+        }
+    }
+    
+    void LoggerClass::init_sink(Message& msg)
+    {
+        // a message longer than the buffer leaves the stream in a failed state
+        msg.sink.clear();
+        msg.sink.seekp(0);
     }
 
     
@@ -250,32 +816,67 @@ namespace XBot {
     
     std::ostream& LoggerClass::log()
     {
-        SET_LOCK_GUARD(*_mutex)
+        Message& msg = message();
         
-        if(_sink.tellp() == 0){
-            memset(_buffer, 0, BUFFER_SIZE);
+        msg.suppressed = false;
+        
+        return msg.sink;
+    }
+    
+    std::ostream& LoggerClass::begin(Logger::Severity s, const std::string& header)
+    {
+        Message& msg = message();
+        
+        // a suppressed message is not composed at all
+        msg.suppressed = !isEnabled(s);
+        
+        if( msg.suppressed ){
+            return msg.null_sink;
         }
         
-        return _sink;
+        msg.severity = s;
+        
+        init_sink(msg);
+        msg.sink << header;
+        return msg.sink;
     }
     
     std::ostream& LoggerClass::info(Logger::Severity s) 
     {
-        SET_LOCK_GUARD(*_mutex)
+        return begin(s, _info_header);
+    };
+    
+    bool LoggerClass::defer(const std::string& header, const char* fmt, va_list args)
+    {
+        AsyncSink * sink = acquire_async();
+        
+        if( !sink ){
+            return false;
+        }
         
-        _severity = s;
+        bool queued = false;
         
-        init_sink();
-        _sink << bold_on << "[info" << _name_tag << "] " << bold_off;
-        return _sink;
-    };
+        if( sink->deferred() ){
+            va_list args_copy;
+            va_copy(args_copy, args);
+            queued = sink->push_format(header.data(), header.size(), fmt, args_copy);
+            va_end(args_copy);
+        }
+        
+        release_async();
+        
+        return queued;
+    }
     
     void XBot::LoggerClass::__fmt_print(const char* fmt, va_list args)
     {
-        int pos = _sink.tellp();
-        int nchars = vsnprintf(&_buffer[pos], (BUFFER_SIZE - pos), fmt, args);
+        Message& msg = message();
         
-        _sink.seekp(std::min(pos + nchars, BUFFER_SIZE - 1));
+        int pos = msg.sink.tellp();
+        
+        int nchars = vsnprintf(&msg.buffer[pos], (BUFFER_SIZE - pos), fmt, args);
+        
+        msg.sink.seekp(std::min(pos + nchars, BUFFER_SIZE - 1));
         
         print();
     }
@@ -304,7 +905,13 @@ namespace XBot {
     
     void XBot::LoggerClass::__info(Logger::Severity s, const char* fmt, va_list args)
     {
-        SET_LOCK_GUARD(*_mutex)
+        if( !isEnabled(s) ){
+            return;
+        }
+        
+        if( defer(_info_header, fmt, args) ){
+            return;
+        }
         
         info(s);
         
@@ -314,13 +921,7 @@ namespace XBot {
         
     std::ostream& LoggerClass::error(Logger::Severity s) 
     {
-        SET_LOCK_GUARD(*_mutex)
-        
-        _severity = s;
-        
-        init_sink();
-        _sink << bold_on << color_red << "[error" << _name_tag << "] " << bold_off << color_red;
-        return _sink;
+        return begin(s, _error_header);
     };
     
     void LoggerClass::error(Logger::Severity s, const char* fmt, ...)
@@ -346,7 +947,13 @@ namespace XBot {
     
     void XBot::LoggerClass::__error(Logger::Severity s, const char* fmt, va_list args)
     {
-        SET_LOCK_GUARD(*_mutex)
+        if( !isEnabled(s) ){
+            return;
+        }
+        
+        if( defer(_error_header, fmt, args) ){
+            return;
+        }
         
         error(s);
         
@@ -355,13 +962,7 @@ namespace XBot {
     
     std::ostream& LoggerClass::warning(Logger::Severity s) 
     {
-        SET_LOCK_GUARD(*_mutex)
-        
-        _severity = s;
-        
-        init_sink();
-        _sink << bold_on << color_yellow << "[warning" << _name_tag << "] " << bold_off << color_yellow;
-        return _sink;
+        return begin(s, _warning_header);
     };
     
     void LoggerClass::warning(Logger::Severity s, const char* fmt, ...)
@@ -387,6 +988,14 @@ namespace XBot {
     
     void XBot::LoggerClass::__warning(Logger::Severity s, const char* fmt, va_list args)
     {
+        if( !isEnabled(s) ){
+            return;
+        }
+        
+        if( defer(_warning_header, fmt, args) ){
+            return;
+        }
+        
         warning(s);
         
         __fmt_print(fmt, args);
@@ -394,13 +1003,7 @@ namespace XBot {
     
     std::ostream& LoggerClass::success(Logger::Severity s) 
     {
-        SET_LOCK_GUARD(*_mutex)
-        
-        _severity = s;
-        
-        init_sink();
-        _sink << bold_on << color_green << "[success" << _name_tag << "] " << bold_off << color_green;
-        return _sink;
+        return begin(s, _success_header);
     };
     
     void LoggerClass::success(Logger::Severity s, const char* fmt, ...)
@@ -427,6 +1030,14 @@ namespace XBot {
     
     void XBot::LoggerClass::__success(Logger::Severity s, const char* fmt, va_list args)
     {
+        if( !isEnabled(s) ){
+            return;
+        }
+        
+        if( defer(_success_header, fmt, args) ){
+            return;
+        }
+        
         success(s);
         
         __fmt_print(fmt, args);
@@ -449,6 +1060,111 @@ namespace XBot {
 
     }
         
+    bool LoggerClass::enableAsync(int queue_size, Logger::OverflowPolicy policy, bool deferred_formatting)
+    {
+        if( _async.load() ){
+            return false;
+        }
+        
+        // the largest message must fit inside the queue
+        if( queue_size <= BUFFER_SIZE / AsyncSink::RECORD_BYTES ){
+            error() << "Queue of the asynchronous output must hold at least " <<
+                BUFFER_SIZE / AsyncSink::RECORD_BYTES + 1 << " records" << _endl;
+            return false;
+        }
+        
+        // messages which have already been printed go first
+        flush();
+        fflush(stdout);
+        
+        AsyncSink * sink = new AsyncSink(queue_size, policy, deferred_formatting);
+        AsyncSink * expected = nullptr;
+        
+        // another thread may have enabled it meanwhile
+        if( !_async.compare_exchange_strong(expected, sink) ){
+            delete sink;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    void LoggerClass::disableAsync()
+    {
+        AsyncSink * sink = _async.exchange(nullptr);
+        
+        if( !sink ){
+            return;
+        }
+        
+        // threads which have picked the sink before the exchange are still pushing to it
+        while( _async_users.load() != 0 ){
+            std::this_thread::yield();
+        }
+        
+        _async_dropped += sink->dropped();
+        delete sink;
+    }
+    
+    AsyncSink * LoggerClass::acquire_async() const
+    {
+        // no need to announce the use of a sink which is not there
+        if( !_async.load(std::memory_order_relaxed) ){
+            return nullptr;
+        }
+        
+        // pairs with disableAsync(): either the sink is seen as removed, or the
+        // removal sees this thread as a user and waits for release_async()
+        _async_users.fetch_add(1);
+        
+        AsyncSink * sink = _async.load();
+        
+        if( !sink ){
+            _async_users.fetch_sub(1);
+        }
+        
+        return sink;
+    }
+    
+    void LoggerClass::release_async() const
+    {
+        _async_users.fetch_sub(1, std::memory_order_release);
+    }
+    
+    void LoggerClass::setFlushPolicy(Logger::Severity flush_severity, int batch_bytes, int max_delay_ms)
+    {
+        // the batches gathered under the previous policy are not left behind
+        flush_pending(false);
+        
+        _batch_bytes = batch_bytes;
+        _max_delay_ms = max_delay_ms;
+        _flush_severity = flush_severity;
+        
+        if( (int)flush_severity > (int)Logger::Severity::DEBUG ){
+            start_flusher();
+        }
+    }
+    
+    void LoggerClass::flush()
+    {
+        Message& msg = message();
+        
+        std::lock_guard<std::mutex> lock(msg.batch_mutex);
+        msg.flush_batch();
+    }
+    
+    uint64_t LoggerClass::getDroppedMessages() const
+    {
+        uint64_t dropped = _async_dropped;
+        
+        if( AsyncSink * sink = acquire_async() ){
+            dropped += sink->dropped();
+            release_async();
+        }
+        
+        return dropped;
+    }
+    
     Endl::Endl(LoggerClass& logger_handle):
         _logger_handle(logger_handle)
     {
@@ -458,29 +1174,339 @@ namespace XBot {
     
     void LoggerClass::print()
     {
-        SET_LOCK_GUARD(*_mutex)
+        Message& msg = message();
+        
+        if( msg.suppressed ){
+            msg.suppressed = false;
+            return;
+        }
+        
+          msg.sink << color_reset;
         
-          _sink << color_reset;
+        // a truncated message leaves the stream failed, its last byte might be a terminator
+        std::streamoff length = msg.sink.tellp();
         
+        if( length < 0 ){
+            length = BUFFER_SIZE - 1;
+        }
         
-        if( (int)_severity >= (int)_verbosity_level ){
+        if( (int)msg.severity >= (int)_verbosity_level.load(std::memory_order_relaxed) ){
             
-            print_internal();
+            print_internal(msg, length);
 
         }
         
-        _severity = Logger::Severity::HIGH;
+        msg.severity = Logger::Severity::HIGH;
         
     }
     
     
-    inline void LoggerClass::print_internal()
+    inline void LoggerClass::print_internal(Message& msg, std::size_t length)
     {
-        DPRINTF("%s\n", _buffer);
+        // the whole message is printed by a single call, so that messages of different threads never mix
+        if( AsyncSink * sink = acquire_async() ){
+            sink->push(msg.buffer, length);
+            release_async();
+            return;
+        }
         
-#if !defined __XENO__ && !defined __COBALT__ 
-        fflush(stdout);
-#endif
+        msg.buffer[length++] = '\n';
+        
+        bool immediate = (int)msg.severity >= (int)_flush_severity.load(std::memory_order_relaxed);
+        
+        // nothing pending (always the case without batching): no need to lock
+        if( immediate && !msg.pending.load(std::memory_order_acquire) ){
+            write_console(msg.buffer, length);
+            return;
+        }
+        
+        // the flusher thread might be writing the batch, the lock also keeps the messages in order
+        std::lock_guard<std::mutex> lock(msg.batch_mutex);
+        
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        
+        if( msg.batch.empty() ){
+            msg.batch_start = now;
+        }
+        
+        // the pending messages go first, by the same call
+        msg.batch.insert(msg.batch.end(), msg.buffer, msg.buffer + length);
+        
+        if( immediate ||
+            msg.batch.size() >= (std::size_t)_batch_bytes.load(std::memory_order_relaxed) ||
+            msg.batch_expired(now) )
+        {
+            msg.flush_batch();
+        }
+        else{
+            msg.pending.store(true, std::memory_order_release);
+        }
+    }
+    
+    
+    /* AsyncSink impl */
+    
+    AsyncSink::AsyncSink(int queue_size, Logger::OverflowPolicy policy, bool deferred_formatting):
+        _capacity(1),
+        _head(0),
+        _tail(0),
+        _dropped(0),
+        _policy(policy),
+        _deferred(deferred_formatting),
+        _text(new char[TEXT_SIZE]),
+        _run(true)
+    {
+        // power of two, so that the slot of a ticket is a mask away
+        while( _capacity < (uint64_t)queue_size ){
+            _capacity <<= 1;
+        }
+        
+        _records.reset(new Record[_capacity]);
+        
+        // record i is free for ticket i
+        for( uint64_t i = 0; i < _capacity; i++ ){
+            _records[i].seq.store(i, std::memory_order_relaxed);
+        }
+        
+        _thread = std::thread(&AsyncSink::run, this);
+    }
+    
+    AsyncSink::~AsyncSink()
+    {
+        _run = false;
+        
+        if( _thread.joinable() ){
+            _thread.join();
+        }
+    }
+    
+    bool AsyncSink::claim(uint64_t n, uint64_t& pos)
+    {
+        const uint64_t mask = _capacity - 1;
+        
+        // claim n consecutive tickets: since records are released in order, they are
+        // all free as soon as the last one is
+        pos = _head.load(std::memory_order_relaxed);
+        
+        while( true ){
+            
+            uint64_t last = pos + n - 1;
+            int64_t diff = (int64_t)(_records[last & mask].seq.load(std::memory_order_acquire) - last);
+            
+            if( diff == 0 ){
+                if( _head.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed) ){
+                    return true;
+                }
+            }
+            else if( diff < 0 ){
+                
+                if( _policy == Logger::OverflowPolicy::Drop || !_run ){
+                    _dropped.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                
+                std::this_thread::yield();
+                pos = _head.load(std::memory_order_relaxed);
+            }
+            else{
+                // another producer got there first
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    void AsyncSink::fill(uint64_t pos, uint64_t n, const char * data, std::size_t len, bool newline, bool binary)
+    {
+        const uint64_t mask = _capacity - 1;
+        
+        for( uint64_t i = 0; i < n; i++ ){
+            
+            Record& record = _records[(pos + i) & mask];
+            std::size_t offset = i * RECORD_BYTES;
+            std::size_t bytes = std::min<std::size_t>(len - std::min(offset, len), RECORD_BYTES);
+            
+            memcpy(record.data, data + offset, bytes);
+            record.len = bytes;
+            record.span = binary && i == 0 ? n : 0;
+            
+            if( newline && i == n - 1 ){
+                record.data[record.len++] = '\n';
+            }
+            
+            record.seq.store(pos + i + 1, std::memory_order_release);
+        }
+    }
+    
+    bool AsyncSink::push(const char * msg, std::size_t len)
+    {
+        uint64_t n = (len + 1 + RECORD_BYTES - 1) / RECORD_BYTES;
+        uint64_t pos;
+        
+        if( !claim(n, pos) ){
+            return false;
+        }
+        
+        fill(pos, n, msg, len, true, false);
+        
+        return true;
+    }
+    
+    bool AsyncSink::push_format(const char * header, std::size_t header_len, const char * fmt, va_list args)
+    {
+        // header length, header, format string, arguments
+        char payload[MESSAGE_SIZE];
+        std::size_t used = 0;
+        
+        uint16_t len = header_len;
+        
+        if( !put_arg(payload, sizeof(payload), used, len) ||
+            used + header_len > sizeof(payload) ){
+            return false;
+        }
+        
+        memcpy(payload + used, header, header_len);
+        used += header_len;
+        
+        if( !put_arg(payload, sizeof(payload), used, fmt) ||
+            !encode_args(fmt, args, payload, sizeof(payload), used) ){
+            return false;
+        }
+        
+        uint64_t n = (used + RECORD_BYTES - 1) / RECORD_BYTES;
+        uint64_t pos;
+        
+        if( !claim(n, pos) ){
+            // dropped, but handled
+            return true;
+        }
+        
+        fill(pos, n, payload, used, false, true);
+        
+        return true;
+    }
+    
+    std::size_t AsyncSink::render(uint64_t first, uint64_t n, char * out, std::size_t size) const
+    {
+        const uint64_t mask = _capacity - 1;
+        char payload[MESSAGE_SIZE];
+        std::size_t bytes = 0;
+        
+        for( uint64_t i = 0; i < n; i++ ){
+            const Record& record = _records[(first + i) & mask];
+            memcpy(payload + bytes, record.data, record.len);
+            bytes += record.len;
+        }
+        
+        const char * in = payload;
+        std::size_t header_len = get_arg<uint16_t>(in);
+        
+        // room for the color reset and the newline
+        const std::size_t trailer = strlen(RT_LOG_RESET) + 1;
+        std::size_t used = std::min(header_len, size - trailer - 1);
+        
+        memcpy(out, in, used);
+        in += header_len;
+        
+        const char * fmt = get_arg<const char *>(in);
+        used += render_args(fmt, in, out + used, size - trailer - used);
+        
+        memcpy(out + used, RT_LOG_RESET "\n", trailer);
+        
+        return used + trailer;
+    }
+    
+    void AsyncSink::run()
+    {
+        // signals are for the threads which are logging
+        sigset_t set;
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        
+        while( _run ){
+            if( drain() == 0 ){
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        
+        while( drain() > 0 );
+    }
+    
+    int AsyncSink::drain()
+    {
+        struct iovec iov[WRITE_BATCH];
+        const uint64_t mask = _capacity - 1;
+        uint64_t count = 0;
+        int n_iov = 0;
+        std::size_t text_used = 0;
+        
+        // published records, in ticket order
+        while( n_iov < WRITE_BATCH ){
+            
+            const Record& record = _records[(_tail + count) & mask];
+            
+            if( record.seq.load(std::memory_order_acquire) != _tail + count + 1 ){
+                break;
+            }
+            
+            if( record.span == 0 ){
+                iov[n_iov].iov_base = const_cast<char *>(record.data);
+                iov[n_iov].iov_len = record.len;
+                n_iov++;
+                count++;
+                continue;
+            }
+            
+            // binary message: rendered as soon as all of its records have been published
+            const Record& last = _records[(_tail + count + record.span - 1) & mask];
+            
+            if( last.seq.load(std::memory_order_acquire) != _tail + count + record.span ||
+                TEXT_SIZE - text_used < MESSAGE_SIZE ){
+                break;
+            }
+            
+            std::size_t len = render(_tail + count, record.span, _text.get() + text_used, MESSAGE_SIZE);
+            
+            iov[n_iov].iov_base = _text.get() + text_used;
+            iov[n_iov].iov_len = len;
+            n_iov++;
+            text_used += len;
+            count += record.span;
+        }
+        
+        struct iovec * next = iov;
+        int left = n_iov;
+        
+        while( left > 0 ){
+            
+            ssize_t ret = writev(STDOUT_FILENO, next, left);
+            
+            if( ret < 0 ){
+                if( errno == EINTR ){
+                    continue;
+                }
+                break;
+            }
+            
+            // skip what has been written, a record might have been written partially
+            while( left > 0 && (std::size_t)ret >= next->iov_len ){
+                ret -= next->iov_len;
+                next++;
+                left--;
+            }
+            
+            if( left > 0 ){
+                next->iov_base = (char *)next->iov_base + ret;
+                next->iov_len -= ret;
+            }
+        }
+        
+        for( uint64_t i = 0; i < count; i++ ){
+            _records[(_tail + i) & mask].seq.store(_tail + i + _capacity, std::memory_order_release);
+        }
+        
+        _tail += count;
+        
+        return count;
     }
 
 
@@ -0,0 +1,17 @@
+#include <XBotLogger/Logger.hpp>
+
+/* Joins the segments of a rotated MatLogger (see MatLogger::StreamingOptions::segment_bytes)
+ * into a single mat file */
+int main(int argc, char **argv){
+
+    if(argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " OUTPUT.mat SEGMENT.mat..." << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> segments(argv + 2, argv + argc);
+
+    return XBot::MatLogger::merge(segments, argv[1]) ? 0 : 1;
+
+}
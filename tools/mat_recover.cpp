@@ -0,0 +1,17 @@
+#include <XBotLogger/Logger.hpp>
+
+/* Rebuilds the mat file of a crashed MatLogger from its ring files (see MatLogger::enableCrashRecovery()
+ * and MatLogger::installSignalHandlers()) */
+int main(int argc, char **argv){
+
+    if(argc < 2 || argc > 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " RING_DIRECTORY [OUTPUT.mat]" << std::endl;
+        return 1;
+    }
+
+    std::string mat_file = argc == 3 ? argv[2] : "";
+
+    return XBot::MatLogger::recover(argv[1], mat_file) ? 0 : 1;
+
+}